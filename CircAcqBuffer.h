@@ -1,9 +1,30 @@
 #pragma once
 #include <cstdint>
+#include <climits>
+#include <cstdio>
+#include <cstring>
 #include <atomic>
 #include <mutex>
+#include <shared_mutex>
 #include <deque>
 #include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CircAcqKernels.h"
+
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+#include <stop_token>
+#define CIRCACQ_HAS_STOP_TOKEN
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 /*
 Push-only ring buffer inspired by ring buffer interface of National Instruments IMAQ software.
@@ -19,6 +40,78 @@ lock_out() returns -1 after timing out.
 If the n-th element has been overwritten, the buffer where the n-th element would have been
 is returned instead along with the count of the element you have actually locked out.
 
+On Linux, enable_eventfd() returns an eventfd that becomes readable when new elements are published so that
+rings can be waited on with epoll alongside other fds. Notifications are coalesced: push() writes to the fd
+only once until the consumer calls acknowledge_eventfd(), after which it should check get_count().
+
+shutdown() wakes every thread waiting in lock_out() immediately with CIRCACQ_SHUTDOWN and makes further
+lock outs fail the same way until clear(). It also signals the eventfd, so consumers waiting in epoll wake up
+and get CIRCACQ_SHUTDOWN from their next lock_out(). Under C++20, lock_out() also accepts a std::stop_token.
+
+With set_lease_timeout(), a lock out that goes longer than the timeout without the holder calling heartbeat()
+is presumed to belong to a dead or stalled consumer and is reclaimed by the next lock_out() so that the other
+consumers keep running. A reclaimed holder must not touch its buffer; release() from the thread that held it
+is ignored so that it can't free the new holder's lock out.
+
+lock_out_frame() returns the lock out as a move-only CircAcqFrame that releases itself when destroyed. With
+set_max_hold(), a lock out held longer than the limit is reclaimed regardless of heartbeats and the frame
+handle reports expired() instead of releasing someone else's lock out.
+
+By default whichever waiting thread happens to win the race gets the lock out next. With set_fair(true),
+threads waiting in lock_out() are served in the order they arrived.
+
+Consumers can register_consumer() and pass their id to lock_out() so that the ring tracks how far each one
+lags behind the head. push() raises a consumer's behind flag (and calls its callback) when its lag reaches the
+high watermark and clears it once the lag has fallen back to the low watermark, so a consumer can switch to
+cheaper processing before its frames are overwritten. Registered consumers also keep counters of frames
+consumed, frames skipped because they were overwritten, timeouts, worst lag and worst wait, which
+get_stats() returns as a snapshot for finding the slow stage of a pipeline.
+
+Each element is stamped when it is published, with the time of the push or a timestamp passed by the caller
+(e.g. from the acquisition hardware). peek() reads the count and timestamp in a slot without locking it out,
+which CircAcqMergedReader uses to merge several rings in timestamp order.
+
+set_layout() has push() store frames transposed (column-major) or in contiguous tiles instead of the row-major
+order they arrive in, so consumers that walk frames column-wise or tile-wise read sequential memory. The
+reorganization happens once in push() rather than once per consumer; get_layout() tells consumers which
+layout lock_out() returns. Frames written through lock_out_head() are stored as written.
+
+set_correction() has push() apply per-pixel dark-frame offset and flat-field gain planes while it copies,
+out = (in - offset) * gain saturated to the element type, so frames land in the ring already corrected.
+
+set_spatial_binning() has push() take frames larger than the element size and bin them NxM into the slot;
+set_temporal_binning() has it accumulate k pushes and publish their sum or mean as one element, returning
+-1 from the pushes that only accumulate. Pixel transforms apply in the order correction, spatial binning,
+temporal binning, layout.
+
+enable_time_major() has push() also maintain a time-major shadow of the last k frames for per-pixel temporal
+processing: for each block of pixels, the block's values from each of the k frames are stored one after the
+other, so a kernel over the window reads sequential memory instead of one value from each of k frames.
+Readers never hold up push(): each block of the shadow is versioned like a seqlock, and a reader whose block
+was written to while it was reading it is told so by release_time_major_block() and reads that block again,
+so readers make progress block by block while the producer runs at rate.
+
+enable_pyramid() has push() also publish 2x2 box-filtered copies of each frame at 1/2, 1/4, ... resolution
+into companion rings, numbered and stamped like the element they were made from, so previews and coarse
+searches read a small ring instead of downsampling full frames themselves.
+
+enable_change_detection() has push() compare each element against the one before it block by block and
+store a bitmap of the blocks whose mean absolute difference exceeds a threshold with the element.
+get_changes() returns it so consumers can process only the changed blocks, or skip unchanged frames.
+
+register_derived() registers a function computing a derived product of a frame (e.g. an FFT magnitude).
+lock_out_derived() returns the product for the frame of count n, computing it only for the first consumer
+to ask and serving the others from a side ring keyed by count. Results are invalidated when the frame's slot
+is overwritten.
+
+enable_overflow() absorbs bursts without sizing the ring for them: when push() is about to overwrite an
+element that the slowest registered consumer hasn't locked out yet, the element is first diverted into a
+pooled overflow area, and lock_out() serves it from there. Entries drain as consumers get past them, and the
+area's pages are returned to the OS with madvise() once it empties.
+
+pin_window() locks the slots of the k newest elements in place so that kernels (see CircAcqWindow.h) can read
+them directly without copying. It holds the lock out for the duration, so unpin_window() promptly.
+
 github.com/sstucker
 2021
 */
@@ -32,12 +125,114 @@ inline int mod2(int a, int b)
 	return r < 0 ? r + b : r;
 }
 
+#define CIRCACQ_MAX_CONSUMERS 16
+#define CIRCACQ_MAX_DERIVED 8
+
+enum CircAcqLayoutType
+{
+	CIRCACQ_ROW_MAJOR = 0,
+	CIRCACQ_TRANSPOSED = 1,  // Column-major
+	CIRCACQ_TILED = 2  // tile_rows x tile_cols tiles stored contiguously, tiles in row-major order
+};
+
+struct CircAcqLayout
+{
+	int type;
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t tile_rows;
+	uint64_t tile_cols;
+};
+
+/*
+Window of the last frames pushed, time-major. Pixel p of the frame in window position t is at
+data[((p / block) * frames + t) * block + p % block]. Window positions are count % frames, so the newest
+frame is at newest % frames and, once the window has filled, the oldest is at (newest + 1) % frames.
+*/
+template <typename T>
+struct CircAcqTimeMajorView
+{
+	const T* data;
+	int frames;  // Window length k
+	uint64_t block;  // Pixels per block
+	uint64_t blocks;  // The last block is padded if block doesn't divide the frame
+	long newest;  // Count of the newest frame pushed when the view was taken, -1 if empty; blocks may be newer
+};
+
+// Returned by lock_out() in place of a count
+enum CircAcqStatus
+{
+	CIRCACQ_TIMED_OUT = -1,
+	CIRCACQ_SHUTDOWN = -2
+};
+
+template <class T>
+class CircAcqFrame;
+
+// Called from the pushing thread with the consumer's lag in elements when it crosses a watermark
+typedef std::function<void(int consumer, long lag, bool behind)> CircAcqWatermarkCallback;
+
+struct CircAcqConsumer
+{
+	std::atomic_bool active;  // Cleared by unregister_consumer(); inactive consumers are skipped and their ids reused
+	std::atomic_long position;  // Count of the last element the consumer locked out
+	long high_watermark;  // Lag at which the consumer is flagged as behind, 0 to disable
+	long low_watermark;  // Lag at which the flag is cleared again
+	std::atomic_bool behind;
+	CircAcqWatermarkCallback callback;
+	std::string name;
+	std::atomic_long consumed;  // Successful lock outs
+	std::atomic_long skipped;  // Elements overwritten before the consumer could lock them out
+	std::atomic_long timeouts;
+	std::atomic_long max_lag;  // Worst lag seen by push()
+	std::atomic<int64_t> max_wait_us;  // Longest successful lock_out() call
+};
+
+struct CircAcqConsumerStats
+{
+	int id;
+	std::string name;
+	long position;
+	long lag;
+	long consumed;
+	long skipped;
+	long timeouts;
+	long max_lag;
+	int64_t max_wait_us;
+};
+
+// Writes the derived product of frame to out, which has the size passed to register_derived()
+template <typename T>
+using CircAcqDerivedFunction = std::function<void(const T* frame, T* out)>;
+
+template <typename T>
+struct CircAcqDerivedSlot
+{
+	T* arr;
+	std::atomic_long count;  // Count of the frame arr was derived from, -1 if invalid
+	std::shared_timed_mutex lock;  // Shared by readers, exclusive while computing
+};
+
+template <typename T>
+struct CircAcqDerived
+{
+	CircAcqDerivedFunction<T> function;
+	uint64_t size;
+	std::deque<CircAcqDerivedSlot<T>> slots;  // Side ring, the result for count n in slot n % ring_size
+	std::atomic_long computed;
+	std::atomic_long served;
+};
+
 template <typename T>
 struct CircAcqElement
 {
 	T* arr;  // the buffer
 	int index;  // position of data in ring 
 	std::atomic_int count;  // the count of the data currently in the buffer. Needs to be atomic as it is polled from outside the lock
+	std::atomic<int64_t> timestamp;  // us since the clock's epoch unless the producer supplies its own timestamps
+	bool external;  // arr is owned by whoever constructed the buffer around it
+	uint64_t* changes;  // Block-change bitmap if enable_change_detection() was called, otherwise NULL
+	long changed_blocks;  // -1 if the element couldn't be compared against the one before it
 };
 
 
@@ -48,166 +243,1982 @@ protected:
 
 	CircAcqElement<T>** ring;
 	CircAcqElement<T>* locked_out_buffer;
+	bool adopted;  // Slots are caller memory, e.g. a mapped snapshot: lock outs are swapped back into their slot on release
 	int ring_size;
 	uint64_t element_size;
 	std::atomic_long count;  // cumulative count
-	std::atomic_int locked;  // index of currently locked out buffer
+	std::atomic<int64_t> locked;  // Token of the current lock out (see _token()), -1 if none, -2 while being claimed or pinned
 	std::atomic_int head;  // Head of buffer (receives push)
 	std::deque<std::mutex> locks;
+	int event_fd;  // -1 unless enable_eventfd() has been called
+	std::atomic_bool event_pending;  // Set by the first publish after acknowledge_eventfd()
+	std::atomic_bool stopping;  // Set by shutdown()
+	std::atomic_int lease_timeout_ms;  // 0 disables reclamation
+	std::atomic<int64_t> lease_heartbeat;  // Time of the holder's last lock out or heartbeat in us since the clock's epoch
+	std::atomic_long reclaimed;  // Number of lock outs reclaimed from unresponsive holders
+	std::atomic_int max_hold_ms;  // 0 allows lock outs to be held indefinitely
+	std::atomic<int64_t> lease_start;  // Time of the current lock out in us since the clock's epoch
+	std::atomic_long lease_generation;  // Incremented by every lock out so stale holders can be told apart
+	std::thread::id holder;  // Thread that made the current lock out, written before the token is published
+	std::mutex stale_lock;
+	std::vector<std::thread::id> stale_holders;  // Threads whose lock outs were reclaimed and that haven't released since
+	std::atomic_int n_stale;
+	std::atomic_bool fair;  // Serve lock outs in arrival order
+	std::mutex waiters_lock;
+	std::deque<long> waiters;  // Tickets of threads waiting to claim the lock out, oldest first
+	long next_ticket;
+	std::atomic_long serving;  // Ticket at the front of waiters, -1 if none
+	CircAcqConsumer consumers[CIRCACQ_MAX_CONSUMERS];
+	std::atomic_int n_consumers;
+	std::mutex consumers_lock;  // Serializes registration
+	CircAcqDerived<T> derived[CIRCACQ_MAX_DERIVED];
+	std::atomic_int n_derived;
+	CircAcqLayout layout;
+	float* correction_offset;  // NULL unless set_correction() was called
+	float* correction_gain;
+	T* staging;  // Intermediate input frame for pushes that go through more than one transform
+	uint64_t input_size;  // Elements per pushed frame: element_size unless spatially binned
+	uint64_t bin_input_rows;
+	uint64_t bin_input_cols;
+	uint64_t bin_rows;  // 1 x 1 unless set_spatial_binning() was called
+	uint64_t bin_cols;
+	bool bin_average;
+	typename CircAcqWide<T>::type* bin_row;  // Row of accumulators for circacq_bin()
+	T* binned;  // Intermediate element-sized frame for pushes that are transformed after binning
+	int temporal_frames;  // 1 unless set_temporal_binning() was called
+	bool temporal_average;
+	int accumulated;  // Pushes accumulated towards the next temporally binned element
+	typename CircAcqWide<T>::type* accumulator;
+	T* time_major;  // Shadow maintained by push() if enable_time_major() was called, otherwise NULL
+	int time_major_frames;
+	uint64_t time_major_block;
+	uint64_t time_major_blocks;
+	std::atomic_long time_major_newest;
+	std::atomic_long* time_major_versions;  // Per block, odd while the block is being written
+	std::atomic_long* time_major_block_newest;  // Per block, count of the newest frame written to it
+	std::mutex time_major_lock;  // Serializes writers only; readers check the block versions instead
+	uint64_t change_rows;  // Element as stored viewed as change_rows x change_cols
+	uint64_t change_cols;
+	uint64_t change_block_rows;
+	uint64_t change_block_cols;
+	uint64_t change_blocks;
+	double change_threshold;
+	typename CircAcqWide<T>::type* change_row;  // Row of accumulators for circacq_block_change(), NULL unless enabled
+	T* overflow;  // Area for elements diverted by push() if enable_overflow() was called, otherwise NULL
+	int overflow_capacity;
+	uint64_t overflow_stride;  // Elements between entries: whole pages, so that drained entries can be returned
+	long* overflow_counts;  // FIFO of diverted elements, in count order from overflow_first
+	int64_t* overflow_timestamps;
+	int overflow_first;
+	int overflow_used;
+	int overflow_peak;
+	bool overflow_dirty;  // Pages have been touched since the area was last returned
+	int64_t overflow_empty_since;  // When the area last emptied, 0 while it holds entries
+	int overflow_return_ms;  // How long the area must stay empty before its pages are returned
+	std::atomic_long overflow_diverted;
+	std::atomic_long overflow_lost;  // Elements the slowest consumer needed that didn't fit
+	std::mutex overflow_lock;
+	CircAcqBuffer<T>** pyramid;  // Companion rings maintained by push() if enable_pyramid() was called, otherwise NULL
+	int pyramid_levels;
+	uint64_t pyramid_rows;
+	uint64_t pyramid_cols;
 
-	inline void _swap(int n)
+	inline void _update_time_major(const T* src, long n)
 	{
-		locked.store(n);  // Update locked out value
+		if (time_major == NULL)
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> guard(time_major_lock);
+		int t = mod2((int)n, time_major_frames);
+		uint64_t b = time_major_block;
+		for (uint64_t i = 0; i < time_major_blocks; i++)
+		{
+			uint64_t first = i * b;
+			_begin_time_major_write(i);
+			memcpy(time_major + (i * time_major_frames + t) * b, src + first, sizeof(T) * std::min(b, element_size - first));
+			time_major_block_newest[i].store(n, std::memory_order_relaxed);
+			_end_time_major_write(i);
+		}
+		time_major_newest.store(n);
+	}
 
-		// Pointer swap
-		CircAcqElement<T>* tmp = locked_out_buffer;
-		locked_out_buffer = ring[n];
-		ring[n] = tmp;
+	inline void _begin_time_major_write(uint64_t i)
+	{
+		time_major_versions[i].store(time_major_versions[i].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);  // Readers that see the writes see the odd version
+	}
 
-		// Update index to buffer's new position in ring
-		ring[n]->index = n;
+	inline void _end_time_major_write(uint64_t i)
+	{
+		time_major_versions[i].store(time_major_versions[i].load(std::memory_order_relaxed) + 1, std::memory_order_release);
 	}
 
-	inline long _lock_out(int n, T** buffer, int timeout_ms)
+	// Called with the slot's lock held once the element is written but before count is incremented
+	inline void _detect_changes(int slot)
 	{
-		auto start = clk::now();  // Start timeout timer
-		int timeout_us = timeout_ms * 1000;  // Compare using integer microseconds
-		while (locked.load() != -1)
+		if (change_row == NULL)
+		{
+			return;
+		}
+		CircAcqElement<T>* e = ring[slot];
+		int prev = mod2(slot - 1, ring_size);
+		e->changed_blocks = -1;
+		if (ring_size > 1 && count.load() >= 0 && locks[prev].try_lock())  // Don't wait: pin_window() may hold prev while it waits for this slot
 		{
-			if (std::chrono::duration_cast<us>(clk::now() - start).count() > timeout_us)
+			if (ring[prev]->count.load() == count.load())  // Not locked out and swapped for the spare
 			{
-				printf("CircAcqBuffer: Timed out waiting for locked out buffer to be released.\n");
-				return -1;
+				e->changed_blocks = circacq_block_change(e->arr, (const T*)ring[prev]->arr, change_rows, change_cols, change_block_rows, change_block_cols, change_threshold, e->changes, change_row);
 			}
+			locks[prev].unlock();
 		}
-		int requested = mod2(n, ring_size);  // Get index of buffer where requested element is/was
-		while (n > ring[requested]->count.load())
+	}
+
+	inline long _slowest_position()
+	{
+		long slowest = LONG_MAX;
+		int n = n_consumers.load();
+		for (int i = 0; i < n; i++)
 		{
-			if (std::chrono::duration_cast<us>(clk::now() - start).count() > timeout_us)
+			if (consumers[i].active.load())
 			{
-				printf("CircAcqBuffer: Timed out trying to acquire %i for %i ms.\n", n, timeout_ms);
-				return -1;
+				slowest = std::min(slowest, consumers[i].position.load());
 			}
 		}
-		while (!locks[requested].try_lock())
+		return slowest;
+	}
+
+	inline void _return_overflow()
+	{
+#ifdef __linux__
+		madvise(overflow, sizeof(T) * overflow_stride * overflow_capacity, MADV_DONTNEED);
+#endif
+		overflow_dirty = false;
+		overflow_empty_since = 0;
+	}
+
+	// Called by the producer with the slot's lock held, before the slot is overwritten
+	inline void _divert(int slot)
+	{
+		if (overflow == NULL)
+		{
+			return;
+		}
+		long slowest = _slowest_position();
+		long old = ring[slot]->count.load();
+		std::lock_guard<std::mutex> guard(overflow_lock);
+		while (overflow_used > 0 && overflow_counts[overflow_first] <= slowest)  // Every consumer is past it
 		{
-			if (std::chrono::duration_cast<us>(clk::now() - start).count() > timeout_us)
+			overflow_first = mod2(overflow_first + 1, overflow_capacity);
+			overflow_used--;
+		}
+		if (overflow_used == 0 && overflow_dirty)  // Return the pages only once the area has stayed empty, not every time a lagging consumer dips under the ring size
+		{
+			int64_t now = _now_us();
+			if (overflow_empty_since == 0)
 			{
-				printf("CircAcqBuffer: Timed out trying to unlock buffer %i for %i ms.\n", requested, timeout_ms);
-				return -1;
+				overflow_empty_since = now;
+			}
+			else if (now - overflow_empty_since >= (int64_t)overflow_return_ms * 1000)
+			{
+				_return_overflow();
 			}
 		}
-		_swap(requested);
-		*buffer = locked_out_buffer->arr;  // Return pointer to locked out buffer's array by reference
-		auto locked_out = locked_out_buffer->count.load();  // Return true count of the locked out buffer
-		locks[requested].unlock();
-		return locked_out;
+		if (old < 0 || old <= slowest || old != count.load() + 1 - ring_size)  // Consumed, or the slot holds a swapped-in spare
+		{
+			return;
+		}
+		if (overflow_used == overflow_capacity)
+		{
+			overflow_lost += 1;
+			return;
+		}
+		int e = mod2(overflow_first + overflow_used, overflow_capacity);
+		memcpy(overflow + e * overflow_stride, ring[slot]->arr, sizeof(T) * element_size);
+		overflow_counts[e] = old;
+		overflow_timestamps[e] = ring[slot]->timestamp.load();
+		overflow_used++;
+		overflow_peak = std::max(overflow_peak, overflow_used);
+		overflow_dirty = true;
+		overflow_empty_since = 0;
+		overflow_diverted += 1;
 	}
 
-public:
+	// Copies element n from the overflow area into the spare. Called with the lock out claimed
+	inline bool _lock_out_overflow(long n)
+	{
+		std::lock_guard<std::mutex> guard(overflow_lock);
+		int lo = 0;
+		int hi = overflow_used;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (overflow_counts[mod2(overflow_first + mid, overflow_capacity)] < n)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		int e = mod2(overflow_first + lo, overflow_capacity);
+		if (lo == overflow_used || overflow_counts[e] != n)
+		{
+			return false;
+		}
+		memcpy(locked_out_buffer->arr, overflow + e * overflow_stride, sizeof(T) * element_size);
+		locked_out_buffer->index = -1;
+		locked_out_buffer->timestamp.store(overflow_timestamps[e]);
+		locked_out_buffer->changed_blocks = -1;
+		locked_out_buffer->count.store(n);
+		return true;
+	}
 
-	CircAcqBuffer()
+	inline void _invalidate_derived(int slot)
 	{
-		ring_size = 0;
-		element_size = 0;
-		head = ATOMIC_VAR_INIT(0);
+		int n = n_derived.load();
+		for (int i = 0; i < n; i++)
+		{
+			derived[i].slots[slot].count.store(-1);
+		}
 	}
 
-	CircAcqBuffer(int number_of_buffers, uint64_t frame_size)
+	// Each level is made from the one above it straight into the level's head slot, all held until the last is done
+	inline void _update_pyramid(const T* src, int64_t timestamp)
 	{
-		ring_size = number_of_buffers;
-		element_size = frame_size;
-		head = ATOMIC_VAR_INIT(0);
-		locked = ATOMIC_VAR_INIT(-1);
-		ring = new CircAcqElement<T>*[ring_size];
-		locks.resize(ring_size);
-		for (int i = 0; i < ring_size; i++)
+		if (pyramid == NULL)
 		{
-			ring[i] = new(CircAcqElement<T>);
-			ring[i]->arr = new T[element_size];
-			ring[i]->index = i;
-			ring[i]->count = -1;
+			return;
+		}
+		uint64_t rows = pyramid_rows;
+		uint64_t cols = pyramid_cols;
+		for (int l = 0; l < pyramid_levels; l++)
+		{
+			T* dst = pyramid[l]->lock_out_head();
+			circacq_downsample2(src, dst, rows, cols);
+			src = dst;
+			rows /= 2;
+			cols /= 2;
+		}
+		for (int l = 0; l < pyramid_levels; l++)
+		{
+			pyramid[l]->release_head(timestamp);
 		}
-		// locked_out_buffer maps to memory swapped in to replace a buffer when it is locked out
-		locked_out_buffer = new(CircAcqElement<T>);
-		locked_out_buffer->arr = new T[element_size];
-		locked_out_buffer->index = -1;
-		locked_out_buffer->count = -1;
-		count = ATOMIC_VAR_INIT(-1);
 	}
 
-	long lock_out(int n, T** buffer, int timeout_ms)
+	/*
+	Applies correction and spatial binning to a pushed frame, writing the element-sized result to out. Returns
+	src untouched if neither is configured.
+	*/
+	inline const T* _transform(const T* src, T* out)
 	{
-		return _lock_out(n, buffer, timeout_ms);
+		const T* frame = src;
+		bool spatial = bin_rows * bin_cols > 1;
+		if (correction_offset != NULL)
+		{
+			T* corrected = spatial ? staging : out;  // Correct straight into out when it's the last step
+			circacq_correct(frame, corrected, correction_offset, correction_gain, input_size);
+			frame = corrected;
+		}
+		if (spatial)
+		{
+			circacq_bin(frame, out, bin_input_rows, bin_input_cols, bin_rows, bin_cols, bin_average, bin_row);
+			frame = out;
+		}
+		return frame;
 	}
 
-	long lock_out(int n, T** buffer)
+	/*
+	Copies a transformed frame into a slot in the configured layout. Returns the frame in row-major order,
+	which is the slot itself unless a layout is set.
+	*/
+	inline const T* _copy_in(T* dst, const T* frame)
 	{
-		return _lock_out(n, buffer, 0);
+		switch (layout.type)
+		{
+		case CIRCACQ_TRANSPOSED:
+			circacq_transpose(frame, dst, layout.rows, layout.cols);
+			return frame;
+		case CIRCACQ_TILED:
+			circacq_tile(frame, dst, layout.rows, layout.cols, layout.tile_rows, layout.tile_cols);
+			return frame;
+		}
+		if (frame != dst)
+		{
+			memcpy(dst, frame, sizeof(T) * element_size);
+		}
+		return dst;
 	}
 
-	void release()
+	inline void _ensure_staging()
 	{
-		locked.store(-1);
+		if (staging == NULL)
+		{
+			staging = new T[input_size];
+		}
+		if (binned == NULL)
+		{
+			binned = new T[element_size];
+		}
 	}
 
-	int push(T* src)
+	// Ids from register_consumer() that haven't been unregistered since
+	inline bool _valid_consumer(int consumer)
 	{
-		int oldhead = head;
-		locks[head].lock();
-		memcpy(ring[head]->arr, src, sizeof(T) * element_size);
-		ring[head]->count.store(count);
-		head = mod2(head + 1, ring_size);
-		count += 1;
-		locks[oldhead].unlock();
-		return oldhead;
+		return consumer >= 0 && consumer < n_consumers.load() && consumers[consumer].active.load();
 	}
 
-	T* lock_out_head()
+	inline void _check_watermarks(long newest)
 	{
-		locks[head].lock();
-		return ring[head]->arr;
+		int n = n_consumers.load();
+		for (int i = 0; i < n; i++)
+		{
+			CircAcqConsumer& c = consumers[i];
+			if (!c.active.load())
+			{
+				continue;
+			}
+			long lag = newest - c.position.load();
+			if (lag > c.max_lag.load())
+			{
+				c.max_lag.store(lag);  // Only the pushing thread writes max_lag
+			}
+			if (c.high_watermark <= 0)
+			{
+				continue;
+			}
+			if (!c.behind.load() && lag >= c.high_watermark)
+			{
+				c.behind.store(true);
+				if (c.callback)
+				{
+					c.callback(i, lag, true);
+				}
+			}
+			else if (c.behind.load() && lag <= c.low_watermark)
+			{
+				c.behind.store(false);
+				if (c.callback)
+				{
+					c.callback(i, lag, false);
+				}
+			}
+		}
 	}
 
-	int release_head()
+	inline void _published(long newest)
 	{
-		count += 1;
-		ring[head]->count = count;
-		int oldhead = head;
-		head = mod2(head + 1, ring_size);
-		locks[oldhead].unlock();
-		return oldhead;
+		_check_watermarks(newest);
+		_notify();
 	}
 
-	int get_count()
+	inline int64_t _now_us()
 	{
-		return count.load();
+		return std::chrono::duration_cast<us>(clk::now().time_since_epoch()).count();
 	}
 
-	void clear()
+	inline bool _lease_expired()
+	{
+		int timeout_ms = lease_timeout_ms.load();
+		int hold_ms = max_hold_ms.load();
+		int64_t now = _now_us();
+		return (timeout_ms > 0 && now - lease_heartbeat.load() > (int64_t)timeout_ms * 1000)
+			|| (hold_ms > 0 && now - lease_start.load() > (int64_t)hold_ms * 1000);
+	}
+
+	// Starts a lock out of the index-th buffer. Returns the token to store in locked
+	inline int64_t _begin_lease(int index)
+	{
+		int64_t now = _now_us();
+		lease_heartbeat.store(now);
+		lease_start.store(now);
+		return _token(++lease_generation, index);
+	}
+
+	// Returns true if thread's lock out had been reclaimed, forgetting it
+	inline bool _forget_stale(std::thread::id thread)
+	{
+		std::lock_guard<std::mutex> guard(stale_lock);
+		for (auto it = stale_holders.begin(); it != stale_holders.end(); it++)
+		{
+			if (*it == thread)
+			{
+				stale_holders.erase(it);
+				n_stale.store((int)stale_holders.size());
+				return true;
+			}
+		}
+		return false;
+	}
+
+	inline void _hold(int64_t token)
+	{
+		std::thread::id self = std::this_thread::get_id();
+		if (n_stale.load() > 0)
+		{
+			_forget_stale(self);  // It has moved on from its reclaimed lock out
+		}
+		holder = self;
+		locked.store(token);
+	}
+
+	// Identifies a lock out by generation and buffer index together, so that one CAS both checks and releases it
+	static inline int64_t _token(long generation, int index)
+	{
+		return ((int64_t)(generation & 0x7FFFFFFF) << 32) | (uint32_t)index;
+	}
+
+	inline void _notify()
+	{
+#ifdef __linux__
+		if (event_fd != -1 && !event_pending.exchange(true))
+		{
+			uint64_t one = 1;
+			if (write(event_fd, &one, sizeof(one)) != sizeof(one))
+			{
+				event_pending.store(false);  // Counter saturated; let the next publish retry
+			}
+		}
+#endif
+	}
+
+	inline void _allocate(int number_of_buffers, uint64_t frame_size, T** slots)
+	{
+		ring_size = number_of_buffers;
+		element_size = frame_size;
+		ring = new CircAcqElement<T>*[ring_size]();
+		locked_out_buffer = NULL;
+		try
+		{
+			_allocate_slots(slots);
+		}
+		catch (...)
+		{
+			// Free whatever was allocated before rethrowing, as the destructor won't run
+			for (int i = 0; i < ring_size && ring[i] != NULL; i++)
+			{
+				if (!ring[i]->external)
+				{
+					delete[] ring[i]->arr;
+				}
+				delete ring[i];
+			}
+			delete[] ring;
+			ring = NULL;
+			if (locked_out_buffer != NULL)
+			{
+				delete[] locked_out_buffer->arr;
+				delete locked_out_buffer;
+				locked_out_buffer = NULL;
+			}
+			throw;
+		}
+	}
+
+	inline void _allocate_slots(T** slots)
 	{
+		locks.resize(ring_size);
 		for (int i = 0; i < ring_size; i++)
 		{
-			locks[i].lock();
+			ring[i] = new(CircAcqElement<T>);
+			ring[i]->arr = NULL;
+			ring[i]->external = slots != NULL;
+			ring[i]->arr = slots != NULL ? slots[i] : new T[element_size];
+			ring[i]->changes = NULL;
+			ring[i]->changed_blocks = -1;
 			ring[i]->index = i;
 			ring[i]->count = -1;
-			locks[i].unlock();
+			ring[i]->timestamp = -1;
 		}
-		count.store(-1);
-		head.store(0);
-		locked.store(-1);
+		// locked_out_buffer maps to memory swapped in to replace a buffer when it is locked out
+		locked_out_buffer = new(CircAcqElement<T>);
+		locked_out_buffer->arr = NULL;
+		locked_out_buffer->arr = new T[element_size];
+		locked_out_buffer->external = false;
+		locked_out_buffer->changes = NULL;
+		locked_out_buffer->changed_blocks = -1;
 		locked_out_buffer->index = -1;
 		locked_out_buffer->count = -1;
+		locked_out_buffer->timestamp = -1;
 	}
 
-	~CircAcqBuffer()
+	inline void _init_state()
 	{
-		for (int i = 0; i < ring_size; i++)
+		adopted = false;
+		head = ATOMIC_VAR_INIT(0);
+		locked = ATOMIC_VAR_INIT(-1);
+		count = ATOMIC_VAR_INIT(-1);
+		event_fd = -1;
+		event_pending = ATOMIC_VAR_INIT(false);
+		stopping = ATOMIC_VAR_INIT(false);
+		lease_timeout_ms = ATOMIC_VAR_INIT(0);
+		lease_heartbeat = ATOMIC_VAR_INIT(0);
+		reclaimed = ATOMIC_VAR_INIT(0);
+		max_hold_ms = ATOMIC_VAR_INIT(0);
+		lease_start = ATOMIC_VAR_INIT(0);
+		lease_generation = ATOMIC_VAR_INIT(0);
+		n_stale = ATOMIC_VAR_INIT(0);
+		fair = ATOMIC_VAR_INIT(false);
+		next_ticket = 0;
+		serving = ATOMIC_VAR_INIT(-1);
+		n_consumers = ATOMIC_VAR_INIT(0);
+		layout = { CIRCACQ_ROW_MAJOR, 1, element_size, 1, element_size };
+		correction_offset = NULL;
+		correction_gain = NULL;
+		staging = NULL;
+		input_size = element_size;
+		bin_input_rows = 1;
+		bin_input_cols = element_size;
+		bin_rows = 1;
+		bin_cols = 1;
+		bin_average = false;
+		bin_row = NULL;
+		binned = NULL;
+		temporal_frames = 1;
+		temporal_average = false;
+		accumulated = 0;
+		accumulator = NULL;
+		time_major = NULL;
+		time_major_frames = 0;
+		time_major_block = 0;
+		time_major_blocks = 0;
+		time_major_newest = ATOMIC_VAR_INIT(-1);
+		time_major_versions = NULL;
+		time_major_block_newest = NULL;
+		n_derived.store(0);
+		change_rows = 0;
+		change_cols = 0;
+		change_block_rows = 0;
+		change_block_cols = 0;
+		change_blocks = 0;
+		change_threshold = 0;
+		change_row = NULL;
+		overflow = NULL;
+		overflow_capacity = 0;
+		overflow_stride = 0;
+		overflow_counts = NULL;
+		overflow_timestamps = NULL;
+		overflow_first = 0;
+		overflow_used = 0;
+		overflow_peak = 0;
+		overflow_dirty = false;
+		overflow_empty_since = 0;
+		overflow_return_ms = 0;
+		overflow_diverted = ATOMIC_VAR_INIT(0);
+		overflow_lost = ATOMIC_VAR_INIT(0);
+		pyramid = NULL;
+		pyramid_levels = 0;
+		pyramid_rows = 0;
+		pyramid_cols = 0;
+	}
+
+	// For adopted slots, which nothing may push to: puts the element the lock out swapped out back into its slot
+	inline void _swap_back()
+	{
+		int i = locked_out_buffer->index;
+		if (!adopted || i < 0)
 		{
-			delete[] ring[i]->arr;
+			return;
 		}
-		delete[] ring;
-		delete locked_out_buffer;
+		std::lock_guard<std::mutex> guard(locks[i]);
+		if (ring[i]->count.load() < locked_out_buffer->count.load())  // Unless the slot has been pushed to since
+		{
+			_swap(i);
+		}
+	}
+
+	inline void _swap(int n)
+	{
+		// Pointer swap
+		CircAcqElement<T>* tmp = locked_out_buffer;
+		locked_out_buffer = ring[n];
+		ring[n] = tmp;
+
+		// Update index to buffer's new position in ring
+		ring[n]->index = n;
+	}
+
+	// 0 while a wait should keep spinning, otherwise the status to return
+	template <typename Cancelled>
+	inline long _wait_status(clk::time_point start, int timeout_us, Cancelled& cancelled)
+	{
+		if (stopping.load() || cancelled())
+		{
+			return CIRCACQ_SHUTDOWN;
+		}
+		if (std::chrono::duration_cast<us>(clk::now() - start).count() > timeout_us)
+		{
+			return CIRCACQ_TIMED_OUT;
+		}
+		return 0;
+	}
+
+	// Claims the lock out so that competing threads can't swap the same spare. Returns 0 once claimed
+	template <typename Cancelled>
+	inline long _claim(clk::time_point start, int timeout_us, Cancelled& cancelled)
+	{
+		long ticket = -1;
+		if (fair.load())
+		{
+			std::lock_guard<std::mutex> guard(waiters_lock);
+			ticket = next_ticket++;
+			waiters.push_back(ticket);
+			if (waiters.size() == 1)
+			{
+				serving.store(ticket);
+			}
+		}
+		long status = 0;
+		int64_t unlocked = -1;
+		while (true)
+		{
+			bool turn = ticket == -1 || serving.load() == ticket;  // Only the oldest waiter may try when fair
+			if (turn)
+			{
+				if (locked.compare_exchange_weak(unlocked, -2))
+				{
+					break;
+				}
+				if (unlocked >= 0 && _lease_expired() && locked.compare_exchange_strong(unlocked, -2))
+				{
+					printf("CircAcqBuffer: Reclaimed lock out of buffer %i from a holder past its lease.\n", (int)(unlocked & 0xFFFFFFFF));
+					reclaimed += 1;
+					_swap_back();
+					std::lock_guard<std::mutex> guard(stale_lock);
+					stale_holders.push_back(holder);
+					n_stale.store((int)stale_holders.size());
+					break;
+				}
+				unlocked = -1;
+			}
+			if ((status = _wait_status(start, timeout_us, cancelled)))
+			{
+				if (status == CIRCACQ_TIMED_OUT)
+				{
+					printf("CircAcqBuffer: Timed out waiting for locked out buffer to be released.\n");
+				}
+				break;
+			}
+		}
+		if (ticket != -1)  // Leave the queue whether or not we got the lock out
+		{
+			std::lock_guard<std::mutex> guard(waiters_lock);
+			for (auto it = waiters.begin(); it != waiters.end(); it++)
+			{
+				if (*it == ticket)
+				{
+					waiters.erase(it);
+					break;
+				}
+			}
+			serving.store(waiters.empty() ? -1 : waiters.front());
+		}
+		return status;
+	}
+
+	template <typename Cancelled>
+	inline long _lock_out(int n, T** buffer, int timeout_ms, Cancelled cancelled, int64_t* lease = NULL)
+	{
+		auto start = clk::now();  // Start timeout timer
+		int timeout_us = timeout_ms * 1000;  // Compare using integer microseconds
+		long status;
+		if (stopping.load())  // Even if n is available: after shutdown() every lock out fails until clear()
+		{
+			return CIRCACQ_SHUTDOWN;
+		}
+		int requested = mod2(n, ring_size);  // Get index of buffer where requested element is/was
+		while (true)
+		{
+			// Wait for the element without the claim, so that waiting on a future element doesn't hold up other consumers
+			while (n > count.load())
+			{
+				if ((status = _wait_status(start, timeout_us, cancelled)))
+				{
+					if (status == CIRCACQ_TIMED_OUT)
+					{
+						printf("CircAcqBuffer: Timed out trying to acquire %i for %i ms.\n", n, timeout_ms);
+					}
+					return status;
+				}
+			}
+			if ((status = _claim(start, timeout_us, cancelled)))
+			{
+				return status;
+			}
+			if (locked_out_buffer->count.load() == n)  // Already swapped out by a previous lock out: nothing writes to the spare, so hand it out again
+			{
+				int64_t token = _begin_lease(requested);
+				if (lease != NULL)
+				{
+					*lease = token;
+				}
+				_hold(token);
+				*buffer = locked_out_buffer->arr;
+				return n;
+			}
+			if (n <= ring[requested]->count.load())
+			{
+				break;
+			}
+			locked.store(-1);  // Not in its slot yet, e.g. the ring was cleared: drop the claim again while waiting
+			if ((status = _wait_status(start, timeout_us, cancelled)))
+			{
+				if (status == CIRCACQ_TIMED_OUT)
+				{
+					printf("CircAcqBuffer: Timed out trying to acquire %i for %i ms.\n", n, timeout_ms);
+				}
+				return status;
+			}
+		}
+		while (!locks[requested].try_lock())
+		{
+			if ((status = _wait_status(start, timeout_us, cancelled)))
+			{
+				if (status == CIRCACQ_TIMED_OUT)
+				{
+					printf("CircAcqBuffer: Timed out trying to unlock buffer %i for %i ms.\n", requested, timeout_ms);
+				}
+				locked.store(-1);
+				return status;
+			}
+		}
+		int64_t token = _begin_lease(requested);
+		if (lease != NULL)
+		{
+			*lease = token;
+		}
+		if (overflow != NULL && ring[requested]->count.load() > n && _lock_out_overflow(n))  // Overwritten, but diverted first
+		{
+			_hold(token);
+			locks[requested].unlock();
+			*buffer = locked_out_buffer->arr;
+			return n;
+		}
+		_swap(requested);
+		_hold(token);
+		*buffer = locked_out_buffer->arr;  // Return pointer to locked out buffer's array by reference
+		auto locked_out = locked_out_buffer->count.load();  // Return true count of the locked out buffer
+		locks[requested].unlock();
+		return locked_out;
+	}
+
+public:
+
+	CircAcqBuffer()
+	{
+		ring_size = 0;
+		element_size = 0;
+		ring = NULL;
+		locked_out_buffer = NULL;
+		_init_state();
+	}
+
+	CircAcqBuffer(int number_of_buffers, uint64_t frame_size)
+	{
+		_allocate(number_of_buffers, frame_size, NULL);
+		_init_state();
+	}
+
+	/*
+	Adopts slot memory owned by the caller, e.g. a mapped snapshot, along with the count and timestamp of the
+	element in each slot. newest is the count of the most recent element. The memory must outlive the buffer.
+	A lock out is swapped back into its slot on release, so each element stays in its own slot for as long as
+	nothing is pushed.
+	*/
+	CircAcqBuffer(int number_of_buffers, uint64_t frame_size, T** slots, const long* counts, const int64_t* timestamps, long newest)
+	{
+		_allocate(number_of_buffers, frame_size, slots);
+		_init_state();
+		adopted = true;
+		for (int i = 0; i < ring_size; i++)
+		{
+			ring[i]->count = counts[i];
+			ring[i]->timestamp = timestamps[i];
+		}
+		count = newest;
+		head = mod2((int)newest + 1, ring_size);
+	}
+
+	long lock_out(int n, T** buffer, int timeout_ms)
+	{
+		return _lock_out(n, buffer, timeout_ms, []() { return false; });
+	}
+
+	/*
+	Pins the k newest elements, which must be fewer than the number of buffers, and returns pointers to them
+	oldest first. push() can't overwrite them and no other thread can lock out until unpin_window(). Returns
+	the count of the newest element, or a CircAcqStatus if the window couldn't be pinned within timeout_ms.
+	*/
+	long pin_window(int k, const T** frames, int timeout_ms)
+	{
+		auto start = clk::now();
+		int timeout_us = timeout_ms * 1000;
+		auto never = []() { return false; };
+		if (k < 1 || k >= ring_size)
+		{
+			printf("CircAcqBuffer: Can't pin a window of %i elements in a ring of %i.\n", k, ring_size);
+			return CIRCACQ_TIMED_OUT;
+		}
+		if (stopping.load())
+		{
+			return CIRCACQ_SHUTDOWN;
+		}
+		long status;
+		if ((status = _claim(start, timeout_us, never)))  // Keeps lock outs from swapping the spare while it may be part of the window
+		{
+			return status;
+		}
+		while (true)
+		{
+			status = 0;
+			long newest = count.load();
+			long oldest = newest - k + 1;
+			int pinned = 0;
+			bool retry = false;
+			for (; oldest >= 0 && pinned < k; pinned++)
+			{
+				long n = oldest + pinned;
+				int i = mod2((int)n, ring_size);
+				while (!locks[i].try_lock())
+				{
+					if ((status = _wait_status(start, timeout_us, never)))
+					{
+						break;
+					}
+				}
+				if (status)
+				{
+					break;
+				}
+				long in_slot = ring[i]->count.load();
+				if (in_slot == n)
+				{
+					frames[pinned] = ring[i]->arr;
+				}
+				else if (locked_out_buffer->count.load() == n)  // Swapped out by an earlier lock out
+				{
+					frames[pinned] = locked_out_buffer->arr;
+				}
+				else
+				{
+					retry = in_slot > n;  // Overwritten while pinning: start again from the new newest
+					locks[i].unlock();
+					break;
+				}
+			}
+			if (pinned == k)
+			{
+				return newest;
+			}
+			for (int j = 0; j < pinned; j++)
+			{
+				locks[mod2((int)(oldest + j), ring_size)].unlock();
+			}
+			if (!status && !retry)
+			{
+				status = _wait_status(start, timeout_us, never);  // Not enough elements yet, or one is out of the ring
+			}
+			if (status)
+			{
+				if (status == CIRCACQ_TIMED_OUT)
+				{
+					printf("CircAcqBuffer: Timed out pinning a window of %i elements for %i ms.\n", k, timeout_ms);
+				}
+				locked.store(-1);
+				return status;
+			}
+		}
+	}
+
+	// newest is the count pin_window() returned
+	void unpin_window(int k, long newest)
+	{
+		for (long n = newest - k + 1; n <= newest; n++)
+		{
+			locks[mod2((int)n, ring_size)].unlock();
+		}
+		locked.store(-1);
+	}
+
+	long lock_out(int n, T** buffer)
+	{
+		return _lock_out(n, buffer, 0, []() { return false; });
+	}
+
+	/*
+	Lock out on behalf of a registered consumer, advancing its position and counters. A consumer of -1 is a plain
+	lock out; any other id that isn't registered returns -1.
+	*/
+	long lock_out(int n, T** buffer, int timeout_ms, int consumer)
+	{
+		if (consumer == -1)
+		{
+			return lock_out(n, buffer, timeout_ms);
+		}
+		if (!_valid_consumer(consumer))
+		{
+			printf("CircAcqBuffer: No registered consumer %i.\n", consumer);
+			return -1;
+		}
+		auto start = clk::now();
+		long locked_out = _lock_out(n, buffer, timeout_ms, []() { return false; });
+		CircAcqConsumer& c = consumers[consumer];
+		if (locked_out >= 0)
+		{
+			int64_t wait = std::chrono::duration_cast<us>(clk::now() - start).count();
+			int64_t worst = c.max_wait_us.load();
+			while (wait > worst && !c.max_wait_us.compare_exchange_weak(worst, wait)) {}
+			c.consumed += 1;
+			if (locked_out > n)
+			{
+				c.skipped += locked_out - n;
+			}
+			set_consumer_position(consumer, locked_out);
+		}
+		else if (locked_out == CIRCACQ_TIMED_OUT)
+		{
+			c.timeouts += 1;
+		}
+		return locked_out;
+	}
+
+#ifdef CIRCACQ_HAS_STOP_TOKEN
+	// Returns CIRCACQ_SHUTDOWN as soon as stop is requested
+	long lock_out(int n, T** buffer, int timeout_ms, std::stop_token stop)
+	{
+		return _lock_out(n, buffer, timeout_ms, [&stop]() { return stop.stop_requested(); });
+	}
+#endif
+
+	// The frame is invalid if the lock out fails; check valid() or count()
+	CircAcqFrame<T> lock_out_frame(int n, int timeout_ms)
+	{
+		T* buffer = NULL;
+		int64_t lease = 0;
+		long locked_out = _lock_out(n, &buffer, timeout_ms, []() { return false; }, &lease);
+		return CircAcqFrame<T>(this, buffer, locked_out, lease);
+	}
+
+	// Wakes all threads waiting in lock_out() with CIRCACQ_SHUTDOWN. Lasts until clear()
+	void shutdown()
+	{
+		stopping.store(true);
+		_notify();  // Wakes consumers waiting on the eventfd rather than in lock_out(); if a notification is already pending the fd is readable
+		for (int l = 0; l < pyramid_levels; l++)
+		{
+			pyramid[l]->shutdown();
+		}
+	}
+
+	void release()
+	{
+		if (n_stale.load() > 0 && _forget_stale(std::this_thread::get_id()))
+		{
+			return;  // The caller's lock out was reclaimed; whatever is locked out now belongs to someone else
+		}
+		int64_t current = locked.load();
+		while (current >= 0 && !locked.compare_exchange_weak(current, adopted ? -2 : -1)) {}  // Never clear a claim in progress
+		if (adopted && current >= 0)
+		{
+			_swap_back();  // Under the claim
+			locked.store(-1);
+		}
+	}
+
+	// Lock outs held longer than timeout_ms without a heartbeat() are reclaimed. 0 disables reclamation
+	void set_lease_timeout(int timeout_ms)
+	{
+		lease_timeout_ms.store(timeout_ms);
+	}
+
+	// Called periodically by the holder of a long lock out to show it is still alive
+	void heartbeat()
+	{
+		lease_heartbeat.store(_now_us());
+	}
+
+	// Lock outs held longer than hold_ms are reclaimed even if the holder is heartbeating. 0 disables the limit
+	void set_max_hold(int hold_ms)
+	{
+		max_hold_ms.store(hold_ms);
+	}
+
+	// Serve threads waiting in lock_out() in arrival order rather than whichever wins the race
+	void set_fair(bool enable)
+	{
+		fair.store(enable);
+	}
+
+	// Returns the consumer's id, or -1 if CIRCACQ_MAX_CONSUMERS are already registered. A high_watermark of 0 disables the flag
+	int register_consumer(long high_watermark = 0, long low_watermark = 0, CircAcqWatermarkCallback callback = nullptr, const char* name = NULL)
+	{
+		std::lock_guard<std::mutex> guard(consumers_lock);
+		int id = 0;
+		while (id < n_consumers.load() && consumers[id].active.load())  // Reuse the id of an unregistered consumer
+		{
+			id++;
+		}
+		if (id == CIRCACQ_MAX_CONSUMERS)
+		{
+			printf("CircAcqBuffer: Can't register more than %i consumers.\n", CIRCACQ_MAX_CONSUMERS);
+			return -1;
+		}
+		CircAcqConsumer& c = consumers[id];
+		c.position.store(count.load());
+		c.high_watermark = high_watermark;
+		c.low_watermark = low_watermark;
+		c.behind.store(false);
+		c.callback = callback;
+		c.name = name != NULL ? name : "consumer " + std::to_string(id);
+		c.consumed.store(0);
+		c.skipped.store(0);
+		c.timeouts.store(0);
+		c.max_lag.store(0);
+		c.max_wait_us.store(0);
+		c.active.store(true);  // Publish only once initialized; push() skips inactive consumers and reads up to n_consumers
+		if (id == n_consumers.load())
+		{
+			n_consumers.store(id + 1);
+		}
+		return id;
+	}
+
+	// For consumers that stop for good, so that they no longer hold back the overflow area, watermarks or stats
+	void unregister_consumer(int consumer)
+	{
+		std::lock_guard<std::mutex> guard(consumers_lock);
+		if (consumer >= 0 && consumer < n_consumers.load())
+		{
+			consumers[consumer].active.store(false);
+		}
+	}
+
+	/*
+	Has push() and release_head() mark which block_rows x block_cols blocks of each element, viewed as stored as
+	rows x cols, differ from the element before by a mean absolute difference of more than threshold. Call
+	before acquisition. Returns 0, or -1 for invalid arguments.
+	*/
+	int enable_change_detection(uint64_t rows, uint64_t cols, uint64_t block_rows, uint64_t block_cols, double threshold)
+	{
+		if (rows * cols != element_size || block_rows < 1 || block_cols < 1 || change_row != NULL)
+		{
+			printf("CircAcqBuffer: Invalid change detection of %llu x %llu frames in %llu x %llu blocks, or already enabled.\n", (unsigned long long)rows, (unsigned long long)cols, (unsigned long long)block_rows, (unsigned long long)block_cols);
+			return -1;
+		}
+		uint64_t across = (cols + block_cols - 1) / block_cols;
+		change_blocks = across * ((rows + block_rows - 1) / block_rows);
+		uint64_t words = (change_blocks + 63) / 64;
+		for (int i = 0; i < ring_size; i++)
+		{
+			std::lock_guard<std::mutex> guard(locks[i]);
+			ring[i]->changes = new uint64_t[words]();
+			ring[i]->changed_blocks = -1;
+		}
+		locked_out_buffer->changes = new uint64_t[words]();
+		locked_out_buffer->changed_blocks = -1;
+		change_rows = rows;
+		change_cols = cols;
+		change_block_rows = block_rows;
+		change_block_cols = block_cols;
+		change_threshold = threshold;
+		change_row = new typename CircAcqWide<T>::type[across];
+		return 0;
+	}
+
+	/*
+	Copies the block-change bitmap of the element of count n, which must be in the ring or locked out by the
+	caller, to bitmap ((blocks + 63) / 64 words, bit i for block i). Returns the number of changed blocks, with
+	every block marked if the element couldn't be compared against the one before it, or -1 if n is gone or
+	change detection isn't enabled.
+	*/
+	long get_changes(long n, uint64_t* bitmap)
+	{
+		if (change_row == NULL || n < 0)
+		{
+			return -1;
+		}
+		uint64_t words = (change_blocks + 63) / 64;
+		CircAcqElement<T>* e = locked_out_buffer;
+		int slot = (int)(n % ring_size);
+		bool in_ring = e->count.load() != n;
+		if (in_ring)
+		{
+			locks[slot].lock();
+			e = ring[slot];
+			if (e->count.load() != n)
+			{
+				locks[slot].unlock();
+				return -1;
+			}
+		}
+		long changed = e->changed_blocks;
+		if (changed >= 0)
+		{
+			memcpy(bitmap, e->changes, sizeof(uint64_t) * words);
+		}
+		if (in_ring)
+		{
+			locks[slot].unlock();
+		}
+		if (changed < 0)
+		{
+			memset(bitmap, 0xFF, sizeof(uint64_t) * words);
+			changed = (long)change_blocks;
+		}
+		return changed;
+	}
+
+	int get_change_blocks()
+	{
+		return (int)change_blocks;
+	}
+
+	/*
+	Lets push() divert up to capacity elements that the slowest registered consumer still needs into an
+	overflow area rather than overwrite them. The area is reserved up front but only backed by memory while in
+	use: once the area has stayed empty for return_ms, its pages are returned. Call before acquisition. Returns
+	0, or -1 for an invalid capacity or if already enabled.
+	*/
+	int enable_overflow(int capacity, int return_ms = 100)
+	{
+		if (capacity < 1 || overflow != NULL)
+		{
+			printf("CircAcqBuffer: Invalid overflow capacity of %i elements, or already enabled.\n", capacity);
+			return -1;
+		}
+		uint64_t bytes = sizeof(T) * element_size;
+#ifdef __linux__
+		uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+		uint64_t stride_bytes = (bytes + page - 1) / page * page;
+		if (stride_bytes % sizeof(T) != 0)
+		{
+			stride_bytes = bytes;  // Entries can't be page-aligned for this element type; they are still returned as a whole
+		}
+		void* area = mmap(NULL, stride_bytes * capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (area == MAP_FAILED)
+		{
+			printf("CircAcqBuffer: Failed to reserve an overflow area of %i elements.\n", capacity);
+			return -1;
+		}
+		overflow = (T*)area;
+#else
+		uint64_t stride_bytes = bytes;
+		overflow = new T[element_size * capacity];
+#endif
+		overflow_stride = stride_bytes / sizeof(T);
+		overflow_counts = new long[capacity];
+		overflow_timestamps = new int64_t[capacity];
+		overflow_capacity = capacity;
+		overflow_return_ms = return_ms;
+		return 0;
+	}
+
+	// Elements in the overflow area now, and the most there have been at once
+	int get_overflow_used(int* peak = NULL)
+	{
+		std::lock_guard<std::mutex> guard(overflow_lock);
+		if (peak != NULL)
+		{
+			*peak = overflow_peak;
+		}
+		return overflow_used;
+	}
+
+	// Elements diverted into the overflow area, and elements lost because it was full
+	long get_overflow_diverted(long* lost = NULL)
+	{
+		if (lost != NULL)
+		{
+			*lost = overflow_lost.load();
+		}
+		return overflow_diverted.load();
+	}
+
+	/*
+	Registers a derived product of size elements computed from a frame by function. Returns the id to pass to
+	lock_out_derived(), or -1 if CIRCACQ_MAX_DERIVED are already registered.
+	*/
+	int register_derived(uint64_t size, CircAcqDerivedFunction<T> function)
+	{
+		std::lock_guard<std::mutex> guard(consumers_lock);
+		int id = n_derived.load();
+		if (id == CIRCACQ_MAX_DERIVED)
+		{
+			printf("CircAcqBuffer: Can't register more than %i derived products.\n", CIRCACQ_MAX_DERIVED);
+			return -1;
+		}
+		CircAcqDerived<T>& d = derived[id];
+		d.function = function;
+		d.size = size;
+		d.slots.resize(ring_size);
+		for (int i = 0; i < ring_size; i++)
+		{
+			d.slots[i].arr = new T[size]();
+			d.slots[i].count.store(-1);
+		}
+		d.computed.store(0);
+		d.served.store(0);
+		n_derived.store(id + 1);  // Publish only once initialized; push() reads up to n_derived
+		return id;
+	}
+
+	/*
+	Returns the derived product of frame, the element of count n which the caller has locked out, computing it
+	if no consumer has yet. The result stays valid until release_derived(id, n), which must follow promptly as
+	it holds off recomputation of the side ring's slot. Returns NULL for an invalid id or count.
+	*/
+	const T* lock_out_derived(int id, long n, const T* frame)
+	{
+		if (id < 0 || id >= n_derived.load() || n < 0)
+		{
+			return NULL;
+		}
+		CircAcqDerived<T>& d = derived[id];
+		CircAcqDerivedSlot<T>& s = d.slots[(int)(n % ring_size)];
+		while (true)
+		{
+			s.lock.lock_shared();
+			if (s.count.load() == n)
+			{
+				d.served += 1;
+				return s.arr;
+			}
+			s.lock.unlock_shared();
+			s.lock.lock();
+			if (s.count.load() != n)  // Another consumer may have computed it while this one waited
+			{
+				d.function(frame, s.arr);
+				s.count.store(n);
+				d.computed += 1;
+			}
+			s.lock.unlock();
+		}
+	}
+
+	void release_derived(int id, long n)
+	{
+		derived[id].slots[(int)(n % ring_size)].lock.unlock_shared();
+	}
+
+	// Number of times the derived product was computed and served. Served - computed is the work saved
+	void get_derived_stats(int id, long* computed, long* served)
+	{
+		*computed = derived[id].computed.load();
+		*served = derived[id].served.load();
+	}
+
+	// For consumers that get frames some other way than lock_out(..., consumer)
+	void set_consumer_position(int consumer, long n)
+	{
+		if (!_valid_consumer(consumer))
+		{
+			return;
+		}
+		std::atomic_long& position = consumers[consumer].position;
+		long current = position.load();
+		while (n > current && !position.compare_exchange_weak(current, n)) {}
+	}
+
+	// Returns -1 for an id that isn't registered
+	long get_lag(int consumer)
+	{
+		if (!_valid_consumer(consumer))
+		{
+			return -1;
+		}
+		return count.load() - consumers[consumer].position.load();
+	}
+
+	bool is_behind(int consumer)
+	{
+		if (!_valid_consumer(consumer))
+		{
+			return false;
+		}
+		return consumers[consumer].behind.load();
+	}
+
+	// Stats of an id that isn't registered have an id of -1 and are otherwise zero
+	CircAcqConsumerStats get_consumer_stats(int consumer)
+	{
+		CircAcqConsumerStats stats;
+		if (!_valid_consumer(consumer))
+		{
+			stats.id = -1;
+			stats.position = -1;
+			stats.lag = 0;
+			stats.consumed = 0;
+			stats.skipped = 0;
+			stats.timeouts = 0;
+			stats.max_lag = 0;
+			stats.max_wait_us = 0;
+			return stats;
+		}
+		CircAcqConsumer& c = consumers[consumer];
+		stats.id = consumer;
+		stats.name = c.name;
+		stats.position = c.position.load();
+		stats.lag = count.load() - stats.position;
+		stats.consumed = c.consumed.load();
+		stats.skipped = c.skipped.load();
+		stats.timeouts = c.timeouts.load();
+		stats.max_lag = c.max_lag.load();
+		stats.max_wait_us = c.max_wait_us.load();
+		return stats;
+	}
+
+	std::vector<CircAcqConsumerStats> get_stats()
+	{
+		std::vector<CircAcqConsumerStats> stats;
+		int n = n_consumers.load();
+		for (int i = 0; i < n; i++)
+		{
+			if (consumers[i].active.load())
+			{
+				stats.push_back(get_consumer_stats(i));
+			}
+		}
+		return stats;
+	}
+
+	long get_reclaimed()
+	{
+		return reclaimed.load();
+	}
+
+	// True while the lock out identified by lease hasn't been released or reclaimed
+	bool lease_valid(int64_t lease)
+	{
+		return locked.load() == lease;
+	}
+
+	// Releases the lock out only if it is still the one identified by lease. Returns false if it had been reclaimed
+	bool release_lease(int64_t lease)
+	{
+		if (!adopted)
+		{
+			return locked.compare_exchange_strong(lease, -1);
+		}
+		if (!locked.compare_exchange_strong(lease, -2))
+		{
+			return false;
+		}
+		_swap_back();
+		locked.store(-1);
+		return true;
+	}
+
+	/*
+	Sets the layout push() stores rows x cols frames in. Tile sizes are only used by CIRCACQ_TILED and must divide
+	rows and cols. Set before acquisition: elements already in the ring keep the layout they were pushed with.
+	Returns 0, or -1 if the type isn't a CircAcqLayoutType or the shape doesn't match the element size.
+	*/
+	int set_layout(int type, uint64_t rows, uint64_t cols, uint64_t tile_rows = 1, uint64_t tile_cols = 1)
+	{
+		if (type != CIRCACQ_ROW_MAJOR && type != CIRCACQ_TRANSPOSED && type != CIRCACQ_TILED)
+		{
+			printf("CircAcqBuffer: Unknown layout type %i.\n", type);
+			return -1;
+		}
+		if (rows * cols != element_size || (type == CIRCACQ_TILED && (tile_rows == 0 || tile_cols == 0 || rows % tile_rows != 0 || cols % tile_cols != 0)))
+		{
+			printf("CircAcqBuffer: Can't lay out %llu elements as %llu x %llu in %llu x %llu tiles.\n", (unsigned long long)element_size,
+				(unsigned long long)rows, (unsigned long long)cols, (unsigned long long)tile_rows, (unsigned long long)tile_cols);
+			return -1;
+		}
+		if (type != CIRCACQ_ROW_MAJOR)
+		{
+			_ensure_staging();  // Before the layout changes, so that a failed allocation leaves the ring as it was
+		}
+		layout = { type, rows, cols, type == CIRCACQ_TILED ? tile_rows : 1, type == CIRCACQ_TILED ? tile_cols : cols };
+		return 0;
+	}
+
+	/*
+	Has push() store (in - offset) * gain per pixel, saturated for integer types. The planes are copied and
+	must have the size of pushed frames, which is larger than the element size if spatially binned. Pass NULL
+	for either to turn correction off. Call before acquisition, after any set_spatial_binning().
+	*/
+	void set_correction(const float* offset, const float* gain)
+	{
+		delete[] correction_offset;
+		delete[] correction_gain;
+		correction_offset = NULL;
+		correction_gain = NULL;
+		if (offset == NULL || gain == NULL)
+		{
+			return;
+		}
+		correction_offset = new float[input_size];
+		correction_gain = new float[input_size];
+		memcpy(correction_offset, offset, sizeof(float) * input_size);
+		memcpy(correction_gain, gain, sizeof(float) * input_size);
+		_ensure_staging();
+	}
+
+	/*
+	Has push() take rows x cols frames and store them binned bin_rows x bin_cols, summed (saturating) or
+	averaged. The binned size must be the element size. Call before acquisition and before set_correction().
+	Returns 0, or -1 if the shapes don't match.
+	*/
+	int set_spatial_binning(uint64_t rows, uint64_t cols, uint64_t bin_rows, uint64_t bin_cols, bool average)
+	{
+		if (bin_rows == 0 || bin_cols == 0 || (rows / bin_rows) * (cols / bin_cols) != element_size || correction_offset != NULL)
+		{
+			printf("CircAcqBuffer: Can't bin %llu x %llu frames %llu x %llu into %llu elements, or correction is already set.\n",
+				(unsigned long long)rows, (unsigned long long)cols, (unsigned long long)bin_rows, (unsigned long long)bin_cols, (unsigned long long)element_size);
+			return -1;
+		}
+		bin_input_rows = rows;
+		bin_input_cols = cols;
+		this->bin_rows = bin_rows;
+		this->bin_cols = bin_cols;
+		bin_average = average;
+		input_size = rows * cols;
+		delete[] staging;
+		staging = NULL;
+		delete[] bin_row;
+		bin_row = new typename CircAcqWide<T>::type[cols];
+		_ensure_staging();
+		return 0;
+	}
+
+	/*
+	Has push() accumulate every frames pushes into one element, published as their sum (saturating) or mean.
+	push() returns -1 while it is only accumulating. Call before acquisition. Returns 0, or -1 if frames < 1.
+	*/
+	int set_temporal_binning(int frames, bool average)
+	{
+		if (frames < 1)
+		{
+			printf("CircAcqBuffer: Can't bin %i frames.\n", frames);
+			return -1;
+		}
+		temporal_frames = frames;
+		temporal_average = average;
+		accumulated = 0;
+		delete[] accumulator;
+		accumulator = new typename CircAcqWide<T>::type[element_size]();
+		_ensure_staging();
+		return 0;
+	}
+
+	CircAcqLayout get_layout()
+	{
+		return layout;
+	}
+
+	/*
+	Has push() maintain a time-major shadow of the last frames pushed, with blocks of block pixels (pick a
+	multiple of the SIMD width). Call before acquisition. Returns 0, or -1 for invalid arguments.
+	*/
+	int enable_time_major(int frames, uint64_t block = 64)
+	{
+		if (frames < 1 || block < 1 || time_major != NULL)
+		{
+			printf("CircAcqBuffer: Invalid time-major window of %i frames in blocks of %llu, or already enabled.\n", frames, (unsigned long long)block);
+			return -1;
+		}
+		time_major_frames = frames;
+		time_major_block = block;
+		time_major_blocks = (element_size + block - 1) / block;
+		time_major = new T[time_major_blocks * frames * block]();
+		time_major_versions = new std::atomic_long[time_major_blocks];
+		time_major_block_newest = new std::atomic_long[time_major_blocks];
+		for (uint64_t i = 0; i < time_major_blocks; i++)
+		{
+			time_major_versions[i].store(0);
+			time_major_block_newest[i].store(-1);
+		}
+		time_major_newest.store(-1);
+		return 0;
+	}
+
+	/*
+	Returns a view of the shadow without holding up push(), which keeps writing to it. Read it block by block:
+	lock_out_time_major_block() before reading block i and release_time_major_block() after, and only use what
+	was read if that returns true; if it returns false, a frame was written to the block meanwhile, so read
+	that block again.
+	*/
+	CircAcqTimeMajorView<T> lock_out_time_major()
+	{
+		return { time_major, time_major_frames, time_major_block, time_major_blocks, time_major_newest.load() };
+	}
+
+	// Returns the version of block i to pass to release_time_major_block(), and the count of its newest frame by reference
+	long lock_out_time_major_block(uint64_t i, long* newest)
+	{
+		long version;
+		while ((version = time_major_versions[i].load(std::memory_order_acquire)) % 2 != 0)  // A write is in progress; it is one block long
+		{
+			std::this_thread::yield();
+		}
+		*newest = time_major_block_newest[i].load(std::memory_order_relaxed);
+		return version;
+	}
+
+	// True if nothing was written to block i since lock_out_time_major_block() returned version
+	bool release_time_major_block(uint64_t i, long version)
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);  // Reads of the block complete before the version is checked
+		return time_major_versions[i].load(std::memory_order_relaxed) == version;
+	}
+
+	/*
+	Has push() maintain levels companion rings of the same ring size, level l holding (rows >> l) x (cols >> l)
+	box-filtered frames. Frames written through lock_out_head() are downsampled as though row-major. Returns 0,
+	or -1 if rows x cols isn't the element size, a level would be empty or the pyramid is already enabled.
+	*/
+	int enable_pyramid(uint64_t rows, uint64_t cols, int levels)
+	{
+		if (levels < 1 || levels > 62 || rows * cols != element_size || (rows >> levels) == 0 || (cols >> levels) == 0 || pyramid != NULL)
+		{
+			printf("CircAcqBuffer: Invalid %i level pyramid of %llu x %llu frames, or already enabled.\n", levels, (unsigned long long)rows, (unsigned long long)cols);
+			return -1;
+		}
+		CircAcqBuffer<T>** levels_ = new CircAcqBuffer<T>*[levels];
+		for (int l = 0; l < levels; l++)
+		{
+			levels_[l] = new CircAcqBuffer<T>(ring_size, (rows >> (l + 1)) * (cols >> (l + 1)));
+			levels_[l]->count.store(count.load());  // Share the main ring's numbering if elements were already pushed
+			levels_[l]->head.store(head.load());
+		}
+		pyramid_rows = rows;
+		pyramid_cols = cols;
+		pyramid_levels = levels;
+		pyramid = levels_;
+		return 0;
+	}
+
+	// The companion ring for level 1 (half resolution) to get_pyramid_levels(), or NULL
+	CircAcqBuffer<T>* get_pyramid_level(int level)
+	{
+		if (pyramid == NULL || level < 1 || level > pyramid_levels)
+		{
+			return NULL;
+		}
+		return pyramid[level - 1];
+	}
+
+	int get_pyramid_levels()
+	{
+		return pyramid_levels;
+	}
+
+	int get_ring_size()
+	{
+		return ring_size;
+	}
+
+	uint64_t get_element_size()
+	{
+		return element_size;
+	}
+
+	// Copies the i-th slot under its lock. Returns the count of the element copied
+	long copy_slot(int i, T* dst, int64_t* timestamp)
+	{
+		std::lock_guard<std::mutex> guard(locks[i]);
+		memcpy(dst, ring[i]->arr, sizeof(T) * element_size);
+		*timestamp = ring[i]->timestamp.load();
+		return ring[i]->count.load();
+	}
+
+	/*
+	Copies the element the last lock out swapped out of the ring, which is no longer in any slot. Takes the
+	claim, so waits for a lock out in progress to be released. Sets n to its count, or -1 if there is none.
+	Returns 0, or a CircAcqStatus if the claim couldn't be taken within timeout_ms.
+	*/
+	long copy_spare(T* dst, long* n, int64_t* timestamp, int timeout_ms)
+	{
+		auto never = []() { return false; };
+		long status;
+		if ((status = _claim(clk::now(), timeout_ms * 1000, never)))
+		{
+			return status;
+		}
+		*n = locked_out_buffer->count.load();
+		if (*n >= 0)
+		{
+			memcpy(dst, locked_out_buffer->arr, sizeof(T) * element_size);
+			*timestamp = locked_out_buffer->timestamp.load();
+		}
+		locked.store(-1);
+		return 0;
+	}
+
+	int push(T* src)
+	{
+		return push(src, _now_us());
+	}
+
+	int push(T* src, int64_t timestamp)
+	{
+		const T* frame = src;
+		if (temporal_frames > 1)
+		{
+			frame = _transform(src, binned);
+			circacq_accumulate(frame, accumulator, element_size);
+			if (++accumulated < temporal_frames)
+			{
+				return -1;
+			}
+			for (uint64_t i = 0; i < element_size; i++)
+			{
+				binned[i] = circacq_narrow<T>(accumulator[i], temporal_frames, temporal_average);
+				accumulator[i] = 0;
+			}
+			accumulated = 0;
+			frame = binned;
+		}
+		int oldhead = head;
+		locks[head].lock();
+		_divert(head);
+		ring[head]->count.store(-1);  // Mark the slot as being written so that peek() can't pair the old count with the new timestamp
+		_invalidate_derived(head);
+		if (temporal_frames == 1)
+		{
+			frame = _transform(src, layout.type == CIRCACQ_ROW_MAJOR ? ring[head]->arr : binned);  // Straight into the slot if nothing follows
+		}
+		frame = _copy_in(ring[head]->arr, frame);
+		_detect_changes(head);
+		ring[head]->timestamp.store(timestamp);
+		count += 1;
+		ring[head]->count.store(count);  // Same numbering as release_head(): the first element pushed is 0
+		head = mod2(head + 1, ring_size);
+		_update_time_major(frame, count.load());  // Under the slot's lock as frame may be the slot
+		_update_pyramid(frame, timestamp);
+		locks[oldhead].unlock();
+		_published(count.load());
+		return oldhead;
+	}
+
+	T* lock_out_head()
+	{
+		locks[head].lock();
+		_divert(head);
+		ring[head]->count.store(-1);
+		_invalidate_derived(head);
+		return ring[head]->arr;
+	}
+
+	int release_head()
+	{
+		return release_head(_now_us());
+	}
+
+	int release_head(int64_t timestamp)
+	{
+		_detect_changes(head);
+		ring[head]->timestamp.store(timestamp);
+		count += 1;
+		ring[head]->count = count;
+		int oldhead = head;
+		head = mod2(head + 1, ring_size);
+		_update_time_major(ring[oldhead]->arr, count.load());  // Still under the slot's lock as the caller's memory is the slot
+		_update_pyramid(ring[oldhead]->arr, timestamp);
+		locks[oldhead].unlock();
+		_published(count.load());
+		return oldhead;
+	}
+
+	// Returns an eventfd that is readable when elements have been published since the last acknowledge_eventfd(), or -1
+	int enable_eventfd()
+	{
+#ifdef __linux__
+		if (event_fd == -1)
+		{
+			event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (event_fd == -1)
+			{
+				printf("CircAcqBuffer: Failed to create eventfd.\n");
+			}
+		}
+		return event_fd;
+#else
+		printf("CircAcqBuffer: eventfd notification is only available on Linux.\n");
+		return -1;
+#endif
+	}
+
+	// Re-arms notification. Call when the fd is readable, then consume elements up to get_count()
+	void acknowledge_eventfd()
+	{
+#ifdef __linux__
+		if (event_fd != -1)
+		{
+			uint64_t drained;
+			while (read(event_fd, &drained, sizeof(drained)) == sizeof(drained)) {}
+			event_pending.store(false);  // Only once drained: a publish after this writes again, one before it is seen by the caller's get_count()
+		}
+#endif
+	}
+
+	int get_count()
+	{
+		return count.load();
+	}
+
+	// Timestamp of the element currently locked out. Only meaningful while holding the lock out
+	int64_t get_locked_out_timestamp()
+	{
+		return locked_out_buffer->timestamp.load();
+	}
+
+	/*
+	Returns the count of the element in the slot where the n-th element is/was without locking it out, and its
+	timestamp by reference. A count below n means the n-th element isn't available yet; above n, that it has
+	been overwritten. Returns -1 if the slot is being written to. An element swapped out of its slot by a
+	lock out is found in the spare once released; while it is locked out, it looks unavailable.
+	*/
+	long peek(int n, int64_t* timestamp)
+	{
+		CircAcqElement<T>* e = ring[mod2(n, ring_size)];
+		long before = e->count.load();
+		*timestamp = e->timestamp.load();
+		if (e->count.load() != before)
+		{
+			return -1;
+		}
+		if (before < n && n <= count.load())
+		{
+			// Published but not in its slot. The spare can only be read under the claim, so only if nobody holds it
+			int64_t unlocked = -1;
+			if (locked.compare_exchange_strong(unlocked, -2))
+			{
+				if (locked_out_buffer->count.load() == n)
+				{
+					*timestamp = locked_out_buffer->timestamp.load();
+					before = n;
+				}
+				locked.store(-1);
+			}
+		}
+		return before;
+	}
+
+	void clear()
+	{
+		for (int i = 0; i < ring_size; i++)
+		{
+			locks[i].lock();
+			ring[i]->index = i;
+			ring[i]->count = -1;
+			ring[i]->timestamp = -1;
+			locks[i].unlock();
+		}
+		count.store(-1);
+		head.store(0);
+		locked.store(-1);
+		if (time_major != NULL)
+		{
+			std::lock_guard<std::mutex> guard(time_major_lock);
+			for (uint64_t i = 0; i < time_major_blocks; i++)
+			{
+				_begin_time_major_write(i);
+				time_major_block_newest[i].store(-1, std::memory_order_relaxed);
+				_end_time_major_write(i);
+			}
+			time_major_newest.store(-1);
+		}
+		for (int l = 0; l < pyramid_levels; l++)
+		{
+			pyramid[l]->clear();
+		}
+		for (int i = 0; i < ring_size; i++)
+		{
+			_invalidate_derived(i);
+		}
+		if (overflow != NULL)
+		{
+			std::lock_guard<std::mutex> guard(overflow_lock);
+			overflow_first = 0;
+			overflow_used = 0;
+			overflow_peak = 0;
+			overflow_diverted.store(0);
+			overflow_lost.store(0);
+			_return_overflow();
+		}
+		stopping.store(false);
+		if (accumulator != NULL)
+		{
+			std::fill(accumulator, accumulator + element_size, 0);
+			accumulated = 0;
+		}
+		for (int i = 0; i < n_consumers.load(); i++)
+		{
+			consumers[i].position.store(-1);
+			consumers[i].behind.store(false);
+			consumers[i].consumed.store(0);
+			consumers[i].skipped.store(0);
+			consumers[i].timeouts.store(0);
+			consumers[i].max_lag.store(0);
+			consumers[i].max_wait_us.store(0);
+		}
+		locked_out_buffer->index = -1;
+		locked_out_buffer->count = -1;
+	}
+
+	~CircAcqBuffer()
+	{
+		for (int i = 0; i < ring_size; i++)
+		{
+			if (!ring[i]->external)
+			{
+				delete[] ring[i]->arr;
+			}
+			delete[] ring[i]->changes;
+			delete ring[i];
+		}
+		delete[] ring;
+		delete[] time_major;
+		delete[] time_major_versions;
+		delete[] time_major_block_newest;
+		delete[] change_row;
+		if (overflow != NULL)
+		{
+#ifdef __linux__
+			munmap(overflow, sizeof(T) * overflow_stride * overflow_capacity);
+#else
+			delete[] overflow;
+#endif
+		}
+		delete[] overflow_counts;
+		delete[] overflow_timestamps;
+		for (int l = 0; l < pyramid_levels; l++)
+		{
+			delete pyramid[l];
+		}
+		delete[] pyramid;
+		for (int i = 0; i < n_derived.load(); i++)
+		{
+			for (int j = 0; j < ring_size; j++)
+			{
+				delete[] derived[i].slots[j].arr;
+			}
+		}
+		delete[] staging;
+		delete[] binned;
+		delete[] bin_row;
+		delete[] accumulator;
+		delete[] correction_offset;
+		delete[] correction_gain;
+		if (locked_out_buffer != NULL)
+		{
+			delete[] locked_out_buffer->changes;
+			if (!locked_out_buffer->external)
+			{
+				delete[] locked_out_buffer->arr;
+			}
+			delete locked_out_buffer;
+		}
+#ifdef __linux__
+		if (event_fd != -1)
+		{
+			close(event_fd);
+		}
+#endif
+	}
+
+};
+
+/*
+Move-only handle to a locked out element. Releases the lock out when destroyed unless it was released
+explicitly or the ring reclaimed it for exceeding its lease, in which case expired() is true and data()
+must no longer be read.
+*/
+template <class T>
+class CircAcqFrame
+{
+protected:
+
+	CircAcqBuffer<T>* buf;
+	T* arr;
+	long n;  // Count of the element locked out, or the status if the lock out failed
+	int64_t lease;  // Token of the lock out, which identifies the buffer actually locked out
+
+public:
+
+	CircAcqFrame()
+	{
+		buf = NULL;
+		arr = NULL;
+		n = CIRCACQ_TIMED_OUT;
+		lease = 0;
+	}
+
+	CircAcqFrame(CircAcqBuffer<T>* ring, T* buffer, long count, int64_t token)
+	{
+		buf = count < 0 ? NULL : ring;
+		arr = buffer;
+		n = count;
+		lease = token;
+	}
+
+	CircAcqFrame(const CircAcqFrame&) = delete;
+	CircAcqFrame& operator=(const CircAcqFrame&) = delete;
+
+	CircAcqFrame(CircAcqFrame&& other)
+	{
+		buf = other.buf;
+		arr = other.arr;
+		n = other.n;
+		lease = other.lease;
+		other.buf = NULL;
+	}
+
+	CircAcqFrame& operator=(CircAcqFrame&& other)
+	{
+		if (this != &other)
+		{
+			release();
+			buf = other.buf;
+			arr = other.arr;
+			n = other.n;
+			lease = other.lease;
+			other.buf = NULL;
+		}
+		return *this;
+	}
+
+	T* data()
+	{
+		return arr;
+	}
+
+	// Count of the element locked out, or the CircAcqStatus if the lock out failed
+	long count()
+	{
+		return n;
+	}
+
+	bool valid()
+	{
+		return buf != NULL && buf->lease_valid(lease);
+	}
+
+	// True if the ring reclaimed the lock out before this handle released it
+	bool expired()
+	{
+		return buf != NULL && !buf->lease_valid(lease);
+	}
+
+	// Returns false if the lock out had already expired
+	bool release()
+	{
+		if (buf == NULL)
+		{
+			return true;
+		}
+		bool released = buf->release_lease(lease);
+		buf = NULL;
+		return released;
+	}
+
+	~CircAcqFrame()
+	{
+		release();
 	}
 
 };
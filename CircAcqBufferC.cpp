@@ -0,0 +1,263 @@
+#define CIRCACQ_BUILD_DLL
+#include "CircAcqBufferC.h"
+#include "CircAcqBuffer.h"
+#include <exception>
+#include <new>
+
+/*
+Implementation of the C ABI. Each handle owns a CircAcqBuffer of the element type requested at
+creation and forwards to it through a switch on that type.
+
+github.com/sstucker
+2021
+*/
+
+static_assert((int)CIRCACQ_LAYOUT_ROW_MAJOR == (int)CIRCACQ_ROW_MAJOR && (int)CIRCACQ_LAYOUT_TRANSPOSED == (int)CIRCACQ_TRANSPOSED
+	&& (int)CIRCACQ_LAYOUT_TILED == (int)CIRCACQ_TILED,
+	"CircAcqStoredLayout must match CircAcqLayoutType");
+
+struct CircAcqHandle
+{
+	int32_t dtype;
+	int32_t itemsize;
+	int32_t ndim;
+	uint64_t shape[CIRCACQ_MAX_DIMS];
+	uint64_t frame_size;
+	void* ring;
+	int32_t layout_ndim;  // Shape of frames as stored, which differs from shape if a layout is set
+	uint64_t layout_shape[CIRCACQ_MAX_DIMS];
+};
+
+#define CIRCACQ_DISPATCH(handle, CALL) \
+	switch (handle->dtype) \
+	{ \
+	case CIRCACQ_UINT8: { typedef uint8_t T; CALL; } \
+	case CIRCACQ_UINT16: { typedef uint16_t T; CALL; } \
+	case CIRCACQ_INT16: { typedef int16_t T; CALL; } \
+	case CIRCACQ_INT32: { typedef int32_t T; CALL; } \
+	case CIRCACQ_FLOAT32: { typedef float T; CALL; } \
+	case CIRCACQ_FLOAT64: { typedef double T; CALL; } \
+	}
+
+#define RING ((CircAcqBuffer<T>*)handle->ring)
+
+// Exceptions (std::bad_alloc from allocating the ring, for one) must not unwind into C callers
+#define CIRCACQ_CATCH(FAILED) \
+	catch (const std::exception& e) \
+	{ \
+		printf("CircAcqBufferC: %s\n", e.what()); \
+		return FAILED; \
+	} \
+	catch (...) \
+	{ \
+		printf("CircAcqBufferC: Unknown exception.\n"); \
+		return FAILED; \
+	}
+
+static int32_t itemsize_of(int32_t dtype)
+{
+	switch (dtype)
+	{
+	case CIRCACQ_UINT8: return 1;
+	case CIRCACQ_UINT16: return 2;
+	case CIRCACQ_INT16: return 2;
+	case CIRCACQ_INT32: return 4;
+	case CIRCACQ_FLOAT32: return 4;
+	case CIRCACQ_FLOAT64: return 8;
+	}
+	return -1;
+}
+
+CircAcqHandle* circacq_create(int32_t dtype, int32_t number_of_buffers, int32_t ndim, const uint64_t* shape)
+{
+	int32_t itemsize = itemsize_of(dtype);
+	if (itemsize < 0 || ndim < 1 || ndim > CIRCACQ_MAX_DIMS || number_of_buffers < 1)
+	{
+		printf("CircAcqBufferC: Invalid dtype %i, ndim %i or number of buffers %i.\n", dtype, ndim, number_of_buffers);
+		return NULL;
+	}
+	CircAcqHandle* handle = new (std::nothrow) CircAcqHandle;
+	if (handle == NULL)
+	{
+		return NULL;
+	}
+	handle->dtype = dtype;
+	handle->itemsize = itemsize;
+	handle->ndim = ndim;
+	handle->frame_size = 1;
+	for (int i = 0; i < CIRCACQ_MAX_DIMS; i++)
+	{
+		handle->shape[i] = i < ndim ? shape[i] : 1;
+		handle->frame_size *= handle->shape[i];
+	}
+	handle->layout_ndim = ndim;
+	memcpy(handle->layout_shape, handle->shape, sizeof(handle->shape));
+	try
+	{
+		CIRCACQ_DISPATCH(handle, handle->ring = new CircAcqBuffer<T>(number_of_buffers, handle->frame_size); break);
+	}
+	catch (...)
+	{
+		printf("CircAcqBufferC: Failed to allocate %i buffers of %llu elements.\n", number_of_buffers, (unsigned long long)handle->frame_size);
+		delete handle;
+		return NULL;
+	}
+	return handle;
+}
+
+void circacq_destroy(CircAcqHandle* handle)
+{
+	if (handle == NULL)
+	{
+		return;
+	}
+	try
+	{
+		CIRCACQ_DISPATCH(handle, delete RING; break);
+	}
+	catch (...)
+	{
+	}
+	delete handle;
+}
+
+int32_t circacq_push(CircAcqHandle* handle, const void* src)
+{
+	try
+	{
+		CIRCACQ_DISPATCH(handle, return RING->push((T*)src));
+	}
+	CIRCACQ_CATCH(-1)
+	return -1;
+}
+
+void* circacq_lock_out_head(CircAcqHandle* handle)
+{
+	try
+	{
+		CIRCACQ_DISPATCH(handle, return RING->lock_out_head());
+	}
+	CIRCACQ_CATCH(NULL)
+	return NULL;
+}
+
+int32_t circacq_release_head(CircAcqHandle* handle)
+{
+	try
+	{
+		CIRCACQ_DISPATCH(handle, return RING->release_head());
+	}
+	CIRCACQ_CATCH(-1)
+	return -1;
+}
+
+int64_t circacq_lock_out(CircAcqHandle* handle, int64_t n, int32_t timeout_ms, CircAcqFrameInfo* frame)
+{
+	if (n < INT_MIN || n > INT_MAX)  // Counts are int in CircAcqBuffer; don't let a truncated n lock out some other element
+	{
+		return -1;
+	}
+	void* data = NULL;
+	long locked_out = -1;
+	try
+	{
+		CIRCACQ_DISPATCH(handle, T* buffer; locked_out = RING->lock_out((int)n, &buffer, timeout_ms); data = buffer; break);
+	}
+	CIRCACQ_CATCH(-1)
+	if (locked_out < 0)
+	{
+		return locked_out;
+	}
+	frame->data = data;
+	frame->count = locked_out;
+	frame->dtype = handle->dtype;
+	frame->itemsize = handle->itemsize;
+	frame->ndim = handle->layout_ndim;
+	memcpy(frame->shape, handle->layout_shape, sizeof(frame->shape));
+	frame->nbytes = handle->frame_size * handle->itemsize;
+	return locked_out;
+}
+
+void circacq_release(CircAcqHandle* handle)
+{
+	try
+	{
+		CIRCACQ_DISPATCH(handle, RING->release(); break);
+	}
+	CIRCACQ_CATCH()
+}
+
+int32_t circacq_set_layout(CircAcqHandle* handle, int32_t type, uint64_t tile_rows, uint64_t tile_cols)
+{
+	if (handle->ndim != 2)
+	{
+		printf("CircAcqBufferC: Layouts need 2D frames.\n");
+		return -1;
+	}
+	uint64_t rows = handle->shape[0];
+	uint64_t cols = handle->shape[1];
+	int32_t result = -1;
+	try
+	{
+		CIRCACQ_DISPATCH(handle, result = RING->set_layout(type, rows, cols, tile_rows, tile_cols); break);
+	}
+	CIRCACQ_CATCH(-1)
+	if (result != 0)
+	{
+		return result;
+	}
+	uint64_t stored[CIRCACQ_MAX_DIMS] = { rows, cols, 1, 1 };
+	handle->layout_ndim = 2;
+	if (type == CIRCACQ_TRANSPOSED)
+	{
+		stored[0] = cols;
+		stored[1] = rows;
+	}
+	else if (type == CIRCACQ_TILED)
+	{
+		stored[0] = rows / tile_rows;
+		stored[1] = cols / tile_cols;
+		stored[2] = tile_rows;
+		stored[3] = tile_cols;
+		handle->layout_ndim = 4;
+	}
+	memcpy(handle->layout_shape, stored, sizeof(stored));
+	return 0;
+}
+
+void circacq_set_correction(CircAcqHandle* handle, const float* offset, const float* gain)
+{
+	try
+	{
+		CIRCACQ_DISPATCH(handle, RING->set_correction(offset, gain); break);
+	}
+	CIRCACQ_CATCH()
+}
+
+void circacq_shutdown(CircAcqHandle* handle)
+{
+	try
+	{
+		CIRCACQ_DISPATCH(handle, RING->shutdown(); break);
+	}
+	CIRCACQ_CATCH()
+}
+
+int64_t circacq_get_count(CircAcqHandle* handle)
+{
+	try
+	{
+		CIRCACQ_DISPATCH(handle, return RING->get_count());
+	}
+	CIRCACQ_CATCH(-1)
+	return -1;
+}
+
+void circacq_clear(CircAcqHandle* handle)
+{
+	try
+	{
+		CIRCACQ_DISPATCH(handle, RING->clear(); break);
+	}
+	CIRCACQ_CATCH()
+}
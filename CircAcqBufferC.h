@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+
+/*
+C ABI for CircAcqBuffer, built as a shared library from CircAcqBufferC.cpp.
+
+Rings are created for one of the common element types below and an N-dimensional frame shape. Lock outs
+fill a CircAcqFrameInfo with a raw pointer to the slot memory, its shape and the count of the element, so
+callers can wrap the frame without copying: numpy via np.frombuffer (see python/circacq.py) and LabVIEW
+by handing data/nbytes to an external data value reference or MoveBlock.
+
+The pointer is valid until circacq_release() is called on the ring.
+
+github.com/sstucker
+2021
+*/
+
+#ifdef _WIN32
+#ifdef CIRCACQ_BUILD_DLL
+#define CIRCACQ_API __declspec(dllexport)
+#else
+#define CIRCACQ_API __declspec(dllimport)
+#endif
+#else
+#define CIRCACQ_API __attribute__((visibility("default")))
+#endif
+
+#define CIRCACQ_MAX_DIMS 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+	CIRCACQ_UINT8 = 0,
+	CIRCACQ_UINT16 = 1,
+	CIRCACQ_INT16 = 2,
+	CIRCACQ_INT32 = 3,
+	CIRCACQ_FLOAT32 = 4,
+	CIRCACQ_FLOAT64 = 5
+} CircAcqDtype;
+
+// Layouts for circacq_set_layout(), with the values of CircAcqLayoutType in CircAcqBuffer.h
+typedef enum
+{
+	CIRCACQ_LAYOUT_ROW_MAJOR = 0,
+	CIRCACQ_LAYOUT_TRANSPOSED = 1,  // Column-major
+	CIRCACQ_LAYOUT_TILED = 2  // tile_rows x tile_cols tiles stored contiguously, tiles in row-major order
+} CircAcqStoredLayout;
+
+typedef struct CircAcqHandle CircAcqHandle;
+
+typedef struct
+{
+	void* data;  // Slot memory of the locked out element
+	int64_t count;  // Count of the element actually locked out
+	int32_t dtype;  // CircAcqDtype
+	int32_t itemsize;  // Bytes per element
+	int32_t ndim;
+	uint64_t shape[CIRCACQ_MAX_DIMS];  // Row-major, unused dimensions are 1
+	uint64_t nbytes;
+} CircAcqFrameInfo;
+
+// Returns NULL if the dtype or shape is invalid or the buffers can't be allocated
+CIRCACQ_API CircAcqHandle* circacq_create(int32_t dtype, int32_t number_of_buffers, int32_t ndim, const uint64_t* shape);
+// Does nothing for NULL
+CIRCACQ_API void circacq_destroy(CircAcqHandle* handle);
+
+// Returns the index of the buffer pushed to
+CIRCACQ_API int32_t circacq_push(CircAcqHandle* handle, const void* src);
+CIRCACQ_API void* circacq_lock_out_head(CircAcqHandle* handle);
+CIRCACQ_API int32_t circacq_release_head(CircAcqHandle* handle);
+
+// Returns the count of the element locked out, or -1 on time out or for an n outside the range of int32_t, and -2 after circacq_shutdown(), in which case frame is left untouched
+CIRCACQ_API int64_t circacq_lock_out(CircAcqHandle* handle, int64_t n, int32_t timeout_ms, CircAcqFrameInfo* frame);
+CIRCACQ_API void circacq_release(CircAcqHandle* handle);
+CIRCACQ_API void circacq_shutdown(CircAcqHandle* handle);
+
+// Per-pixel (in - offset) * gain applied by push(), saturated for integer types. NULL planes turn it off
+CIRCACQ_API void circacq_set_correction(CircAcqHandle* handle, const float* offset, const float* gain);
+
+/*
+Stores 2D frames transposed or tiled (see CircAcqStoredLayout). Lock outs then report the shape of the stored
+layout: (cols, rows) when transposed, (rows / tile_rows, cols / tile_cols, tile_rows, tile_cols) when tiled.
+Returns 0, or -1 if the type isn't a CircAcqStoredLayout, the ring's frames aren't 2D or the tiles don't divide them.
+*/
+CIRCACQ_API int32_t circacq_set_layout(CircAcqHandle* handle, int32_t type, uint64_t tile_rows, uint64_t tile_cols);
+
+CIRCACQ_API int64_t circacq_get_count(CircAcqHandle* handle);
+CIRCACQ_API void circacq_clear(CircAcqHandle* handle);
+
+#ifdef __cplusplus
+}
+#endif
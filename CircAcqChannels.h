@@ -0,0 +1,143 @@
+#pragma once
+#include "CircAcqBuffer.h"
+#include <vector>
+
+/*
+One CircAcqBuffer per channel of a digitizer that interleaves its channels sample by sample.
+
+push_interleaved() reads the interleaved source once and deinterleaves it straight into each channel ring's
+head slot (SIMD shuffles, see circacq_deinterleave()), then publishes every ring with the same timestamp.
+The rings are only ever published together, so the element of count n in one channel was acquired with the
+element of count n in every other.
+
+The rings can be owned by the CircAcqChannelBuffer or existing rings of equal element size and count passed
+in; they must not be pushed to other than through push_interleaved(). Rings that don't match are rejected:
+valid() is false and push_interleaved() returns -1 without touching them.
+
+github.com/sstucker
+2021
+*/
+
+template <class T>
+class CircAcqChannelBuffer
+{
+protected:
+
+	std::vector<CircAcqBuffer<T>*> rings;
+	std::vector<T*> heads;  // Head slot of each ring during push_interleaved()
+	uint64_t samples;
+	bool owned;
+	bool matched;  // Every ring has samples elements and the same count
+
+public:
+
+	CircAcqChannelBuffer(int channels, int number_of_buffers, uint64_t samples_per_channel)
+	{
+		for (int i = 0; i < channels; i++)
+		{
+			rings.push_back(new CircAcqBuffer<T>(number_of_buffers, samples_per_channel));
+		}
+		heads.resize(channels);
+		samples = samples_per_channel;
+		owned = true;
+		matched = channels > 0;
+	}
+
+	// Around existing rings, which must have the same element size and count. They are not deleted with this
+	CircAcqChannelBuffer(const std::vector<CircAcqBuffer<T>*>& channel_rings)
+	{
+		rings = channel_rings;
+		heads.resize(rings.size());
+		samples = rings.empty() ? 0 : rings[0]->get_element_size();
+		owned = false;
+		matched = !rings.empty();
+		for (CircAcqBuffer<T>* r : rings)
+		{
+			if (r->get_element_size() != samples || r->get_count() != rings[0]->get_count())
+			{
+				printf("CircAcqChannelBuffer: Channel rings differ in element size or count.\n");
+				matched = false;
+				break;
+			}
+		}
+	}
+
+	// Owned rings are deleted with this, so a copy would delete them twice
+	CircAcqChannelBuffer(const CircAcqChannelBuffer&) = delete;
+	CircAcqChannelBuffer& operator=(const CircAcqChannelBuffer&) = delete;
+
+	// False if the rings passed in didn't match, in which case nothing can be pushed
+	bool valid()
+	{
+		return matched;
+	}
+
+	int push_interleaved(const T* src)
+	{
+		return push_interleaved(src, std::chrono::duration_cast<us>(clk::now().time_since_epoch()).count());
+	}
+
+	// src holds samples_per_channel x channels elements, channel fastest. Returns the slot written in each ring, or -1 if !valid()
+	int push_interleaved(const T* src, int64_t timestamp)
+	{
+		if (!matched)
+		{
+			return -1;
+		}
+		for (size_t c = 0; c < rings.size(); c++)
+		{
+			heads[c] = rings[c]->lock_out_head();
+		}
+		circacq_deinterleave(src, heads.data(), (int)rings.size(), samples);
+		int slot = -1;
+		for (CircAcqBuffer<T>* r : rings)
+		{
+			slot = r->release_head(timestamp);
+		}
+		return slot;
+	}
+
+	CircAcqBuffer<T>* channel(int i)
+	{
+		return rings[i];
+	}
+
+	int get_channel_count()
+	{
+		return (int)rings.size();
+	}
+
+	// Count of the newest element, common to every channel
+	long get_count()
+	{
+		return rings.empty() ? -1 : rings[0]->get_count();
+	}
+
+	void shutdown()
+	{
+		for (CircAcqBuffer<T>* r : rings)
+		{
+			r->shutdown();
+		}
+	}
+
+	void clear()
+	{
+		for (CircAcqBuffer<T>* r : rings)
+		{
+			r->clear();
+		}
+	}
+
+	~CircAcqChannelBuffer()
+	{
+		if (owned)
+		{
+			for (CircAcqBuffer<T>* r : rings)
+			{
+				delete r;
+			}
+		}
+	}
+
+};
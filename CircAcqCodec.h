@@ -0,0 +1,216 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/*
+Fast lossless codec for frames of integer samples, used by CircAcqRecorder.
+
+Each sample is predicted by the one before it (the previous pixel in the row, or the end of the previous
+row) and the difference zigzag-coded so that small differences of either sign are small numbers. Blocks of
+CIRCACQ_CODEC_BLOCK differences are then bit-packed at the width of the largest in the block, which is
+stored in front of the block in one byte. Smooth images and low-noise sensors pack to a few bits per sample,
+and a noisy block never costs more than a byte over the raw samples.
+
+Floating-point frames round-trip exactly too, as samples are coded by their bits, but compress poorly.
+
+github.com/sstucker
+2021
+*/
+
+#define CIRCACQ_CODEC_BLOCK 32
+
+// Unsigned integer of the same size as T, for coding samples by their bits
+template <typename T>
+struct CircAcqBits
+{
+	typedef typename std::conditional<sizeof(T) == 1, uint8_t,
+		typename std::conditional<sizeof(T) == 2, uint16_t,
+		typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type>::type>::type type;
+};
+
+// Worst case size in bytes of n coded samples
+template <typename T>
+inline uint64_t circacq_encode_bound(uint64_t n)
+{
+	return ((n + CIRCACQ_CODEC_BLOCK - 1) / CIRCACQ_CODEC_BLOCK) * (1 + CIRCACQ_CODEC_BLOCK * sizeof(T)) + 8;
+}
+
+class CircAcqBitWriter
+{
+	uint8_t* dst;
+	uint64_t acc;
+	int bits;
+
+public:
+
+	CircAcqBitWriter(uint8_t* out) : dst(out), acc(0), bits(0) {}
+
+	// Appends the low width bits of v, width <= 32
+	inline void put(uint64_t v, int width)
+	{
+		acc |= v << bits;
+		bits += width;
+		while (bits >= 8)
+		{
+			*dst++ = (uint8_t)acc;
+			acc >>= 8;
+			bits -= 8;
+		}
+	}
+
+	inline void put_wide(uint64_t v, int width)
+	{
+		if (width > 32)
+		{
+			put(v & 0xFFFFFFFF, 32);
+			put(v >> 32, width - 32);
+		}
+		else
+		{
+			put(v, width);
+		}
+	}
+
+	// Pads to a whole byte and returns the end of the output
+	inline uint8_t* flush()
+	{
+		if (bits > 0)
+		{
+			*dst++ = (uint8_t)acc;
+		}
+		acc = 0;
+		bits = 0;
+		return dst;
+	}
+};
+
+class CircAcqBitReader
+{
+	const uint8_t* src;
+	uint64_t acc;
+	int bits;
+
+public:
+
+	CircAcqBitReader(const uint8_t* in) : src(in), acc(0), bits(0) {}
+
+	inline uint64_t get(int width)
+	{
+		while (bits < width)
+		{
+			acc |= (uint64_t)(*src++) << bits;
+			bits += 8;
+		}
+		uint64_t v = width == 0 ? 0 : acc & (~(uint64_t)0 >> (64 - width));
+		acc >>= width;
+		bits -= width;
+		return v;
+	}
+
+	inline uint64_t get_wide(int width)
+	{
+		if (width > 32)
+		{
+			uint64_t lo = get(32);
+			return lo | (get(width - 32) << 32);
+		}
+		return get(width);
+	}
+};
+
+// Codes n samples of src into dst, which must hold circacq_encode_bound<T>(n) bytes. Returns the bytes written
+template <typename T>
+inline uint64_t circacq_encode(const T* src, uint64_t n, uint8_t* dst)
+{
+	typedef typename CircAcqBits<T>::type U;
+	const int w = 8 * sizeof(T);
+	const uint64_t mask = ~(uint64_t)0 >> (64 - w);
+	uint64_t z[CIRCACQ_CODEC_BLOCK];
+	uint64_t prev = 0;
+	CircAcqBitWriter out(dst);
+	for (uint64_t i = 0; i < n; i += CIRCACQ_CODEC_BLOCK)
+	{
+		uint64_t len = n - i < CIRCACQ_CODEC_BLOCK ? n - i : CIRCACQ_CODEC_BLOCK;
+		uint64_t any = 0;
+		for (uint64_t j = 0; j < len; j++)
+		{
+			U bits;
+			memcpy(&bits, src + i + j, sizeof(T));
+			uint64_t d = ((uint64_t)bits - prev) & mask;
+			prev = bits;
+			z[j] = ((d << 1) & mask) ^ ((d >> (w - 1)) ? mask : 0);  // Zigzag: 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+			any |= z[j];
+		}
+		int width = 0;
+		while (width < w && (any >> width) != 0)
+		{
+			width++;
+		}
+		out.put(width, 8);
+		for (uint64_t j = 0; j < len; j++)
+		{
+			out.put_wide(z[j], width);
+		}
+	}
+	return out.flush() - dst;
+}
+
+/*
+Whether size bytes at src hold n samples coded by circacq_encode(): every block width is at most the bits of
+T and the blocks end within size. Only reads the block widths, so check untrusted data with it before
+circacq_decode(), which trusts the stream.
+*/
+template <typename T>
+inline bool circacq_check_coded(const uint8_t* src, uint64_t size, uint64_t n)
+{
+	const uint64_t w = 8 * sizeof(T);
+	const uint64_t bits = size * 8;
+	uint64_t pos = 0;  // In bits
+	for (uint64_t i = 0; i < n; i += CIRCACQ_CODEC_BLOCK)
+	{
+		uint64_t len = n - i < CIRCACQ_CODEC_BLOCK ? n - i : CIRCACQ_CODEC_BLOCK;
+		if (bits < 8 || pos > bits - 8)
+		{
+			return false;
+		}
+		uint64_t byte = pos / 8;
+		int shift = (int)(pos % 8);
+		uint64_t width = src[byte] >> shift;
+		if (shift > 0)
+		{
+			width |= (uint64_t)src[byte + 1] << (8 - shift);  // Within size as pos + 8 <= bits
+		}
+		width &= 0xFF;
+		if (width > w)
+		{
+			return false;
+		}
+		pos += 8 + len * width;
+	}
+	return pos <= bits;
+}
+
+// Decodes n samples coded by circacq_encode() from src into dst
+template <typename T>
+inline void circacq_decode(const uint8_t* src, uint64_t n, T* dst)
+{
+	typedef typename CircAcqBits<T>::type U;
+	const int w = 8 * sizeof(T);
+	const uint64_t mask = ~(uint64_t)0 >> (64 - w);
+	uint64_t prev = 0;
+	CircAcqBitReader in(src);
+	for (uint64_t i = 0; i < n; i += CIRCACQ_CODEC_BLOCK)
+	{
+		uint64_t len = n - i < CIRCACQ_CODEC_BLOCK ? n - i : CIRCACQ_CODEC_BLOCK;
+		int width = (int)in.get(8);
+		for (uint64_t j = 0; j < len; j++)
+		{
+			uint64_t z = in.get_wide(width);
+			uint64_t d = (z >> 1) ^ ((z & 1) ? mask : 0);
+			prev = (prev + d) & mask;
+			U bits = (U)prev;
+			memcpy(dst + i + j, &bits, sizeof(T));
+		}
+	}
+}
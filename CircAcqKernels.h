@@ -0,0 +1,438 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CIRCACQ_SSE2
+#endif
+
+/*
+Copy kernels used by CircAcqBuffer::push() to transform frames on their way into the ring.
+
+All kernels take a source frame in row-major order. Where SSE2 is available, 16 and 32-bit elements are
+transposed in registers (8x8 and 4x4 at a time); everything else falls back to scalar loops the compiler
+can vectorize.
+
+github.com/sstucker
+2021
+*/
+
+#define CIRCACQ_TRANSPOSE_BLOCK 32  // Rows and columns of the cache block a transpose works through at a time
+
+#ifdef CIRCACQ_SSE2
+
+// Transposes eight registers of eight 16-bit elements in place
+inline void circacq_unpack8x8_16(__m128i* r)
+{
+	__m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+	__m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+	__m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+	__m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+	__m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+	__m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+	__m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+	__m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+	__m128i b0 = _mm_unpacklo_epi32(a0, a2);
+	__m128i b1 = _mm_unpackhi_epi32(a0, a2);
+	__m128i b2 = _mm_unpacklo_epi32(a1, a3);
+	__m128i b3 = _mm_unpackhi_epi32(a1, a3);
+	__m128i b4 = _mm_unpacklo_epi32(a4, a6);
+	__m128i b5 = _mm_unpackhi_epi32(a4, a6);
+	__m128i b6 = _mm_unpacklo_epi32(a5, a7);
+	__m128i b7 = _mm_unpackhi_epi32(a5, a7);
+	r[0] = _mm_unpacklo_epi64(b0, b4);
+	r[1] = _mm_unpackhi_epi64(b0, b4);
+	r[2] = _mm_unpacklo_epi64(b1, b5);
+	r[3] = _mm_unpackhi_epi64(b1, b5);
+	r[4] = _mm_unpacklo_epi64(b2, b6);
+	r[5] = _mm_unpackhi_epi64(b2, b6);
+	r[6] = _mm_unpacklo_epi64(b3, b7);
+	r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// Transposes four registers of four 32-bit elements in place
+inline void circacq_unpack4x4_32(__m128i* r)
+{
+	__m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+	__m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+	__m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+	__m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+	r[0] = _mm_unpacklo_epi64(t0, t1);
+	r[1] = _mm_unpackhi_epi64(t0, t1);
+	r[2] = _mm_unpacklo_epi64(t2, t3);
+	r[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+// dst[c][r] = src[r][c] for an 8x8 block of 16-bit elements
+inline void circacq_transpose8x8_16(const void* src, uint64_t src_stride, void* dst, uint64_t dst_stride)
+{
+	const int16_t* s = (const int16_t*)src;
+	int16_t* d = (int16_t*)dst;
+	__m128i r[8];
+	for (int i = 0; i < 8; i++)
+	{
+		r[i] = _mm_loadu_si128((const __m128i*)(s + i * src_stride));
+	}
+	circacq_unpack8x8_16(r);
+	for (int i = 0; i < 8; i++)
+	{
+		_mm_storeu_si128((__m128i*)(d + i * dst_stride), r[i]);
+	}
+}
+
+// dst[c][r] = src[r][c] for a 4x4 block of 32-bit elements
+inline void circacq_transpose4x4_32(const void* src, uint64_t src_stride, void* dst, uint64_t dst_stride)
+{
+	const int32_t* s = (const int32_t*)src;
+	int32_t* d = (int32_t*)dst;
+	__m128i r[4];
+	for (int i = 0; i < 4; i++)
+	{
+		r[i] = _mm_loadu_si128((const __m128i*)(s + i * src_stride));
+	}
+	circacq_unpack4x4_32(r);
+	for (int i = 0; i < 4; i++)
+	{
+		_mm_storeu_si128((__m128i*)(d + i * dst_stride), r[i]);
+	}
+}
+
+#endif
+
+// Accumulator type for sums of T: wide enough for sums of a few thousand 8 or 16-bit values without overflow
+template <typename T>
+struct CircAcqWide
+{
+	typedef typename std::conditional<std::is_floating_point<T>::value, double,
+		typename std::conditional<(sizeof(T) < 4), int32_t, int64_t>::type>::type type;
+};
+
+// Rounds to nearest (ties to even, like the SIMD conversions) and saturates to T's range when T is an integer type
+template <typename T, typename F>
+inline T circacq_saturate(F v)
+{
+	if (std::is_integral<T>::value)
+	{
+		// Compare in double and return the limits themselves: a 32 or 64-bit limit rounds up in float (and 64-bit in double)
+		double d = (double)v;
+		if (!(d > (double)std::numeric_limits<T>::min()))  // Also catches NaN
+		{
+			return std::numeric_limits<T>::min();
+		}
+		if (d >= (double)std::numeric_limits<T>::max())
+		{
+			return std::numeric_limits<T>::max();
+		}
+		return (T)std::nearbyint(d);
+	}
+	return (T)v;
+}
+
+// Saturates an accumulated sum to T, dividing by n first if averaging
+template <typename T>
+inline T circacq_narrow(typename CircAcqWide<T>::type sum, uint64_t n, bool average)
+{
+	if (average)
+	{
+		return circacq_saturate<T>((double)sum / (double)n);
+	}
+	if (std::is_integral<T>::value)
+	{
+		typedef typename CircAcqWide<T>::type W;
+		const W lo = (W)std::numeric_limits<T>::min();
+		const W hi = (W)std::numeric_limits<T>::max();
+		return (T)(sum < lo ? lo : (sum > hi ? hi : sum));
+	}
+	return (T)sum;
+}
+
+/*
+Bins a rows x cols frame into (rows / bin_rows) x (cols / bin_cols), summing or averaging each bin. Input rows
+are first summed vertically into row, a scratch of cols accumulators, which vectorizes; then each run of
+bin_cols is summed horizontally. Trailing rows and columns that don't fill a bin are dropped.
+*/
+template <typename T>
+inline void circacq_bin(const T* src, T* dst, uint64_t rows, uint64_t cols, uint64_t bin_rows, uint64_t bin_cols, bool average, typename CircAcqWide<T>::type* row)
+{
+	typedef typename CircAcqWide<T>::type W;
+	uint64_t out_rows = rows / bin_rows;
+	uint64_t out_cols = cols / bin_cols;
+	uint64_t n = bin_rows * bin_cols;
+	for (uint64_t r = 0; r < out_rows; r++)
+	{
+		const T* in = src + r * bin_rows * cols;
+		for (uint64_t c = 0; c < cols; c++)
+		{
+			row[c] = (W)in[c];
+		}
+		for (uint64_t i = 1; i < bin_rows; i++)
+		{
+			in += cols;
+			for (uint64_t c = 0; c < cols; c++)
+			{
+				row[c] += (W)in[c];
+			}
+		}
+		T* out = dst + r * out_cols;
+		for (uint64_t c = 0; c < out_cols; c++)
+		{
+			W sum = 0;
+			for (uint64_t j = 0; j < bin_cols; j++)
+			{
+				sum += row[c * bin_cols + j];
+			}
+			out[c] = circacq_narrow<T>(sum, n, average);
+		}
+	}
+}
+
+// 2x2 box filter: dst is (rows / 2) x (cols / 2), each element the rounded mean of a 2x2 block of src
+template <typename T>
+inline void circacq_downsample2(const T* src, T* dst, uint64_t rows, uint64_t cols)
+{
+	typedef typename CircAcqWide<T>::type W;
+	uint64_t out_rows = rows / 2;
+	uint64_t out_cols = cols / 2;
+	for (uint64_t r = 0; r < out_rows; r++)
+	{
+		const T* a = src + 2 * r * cols;
+		const T* b = a + cols;
+		T* out = dst + r * out_cols;
+		for (uint64_t c = 0; c < out_cols; c++)  // Branch-free so that the compiler vectorizes it
+		{
+			W sum = (W)a[2 * c] + (W)a[2 * c + 1] + (W)b[2 * c] + (W)b[2 * c + 1];
+			out[c] = std::is_integral<T>::value ? (T)((sum + 2) / 4) : (T)(sum * 0.25);  // The mean of four T's is always in T's range
+		}
+	}
+}
+
+/*
+Sets bit i of bitmap for each block_rows x block_cols block i (blocks in row-major order, partial blocks at
+the edges) whose mean absolute difference between a and b exceeds threshold, and clears the others. row
+holds one accumulator per block column. Returns the number of blocks set.
+*/
+template <typename T>
+inline long circacq_block_change(const T* a, const T* b, uint64_t rows, uint64_t cols, uint64_t block_rows, uint64_t block_cols, double threshold, uint64_t* bitmap, typename CircAcqWide<T>::type* row)
+{
+	typedef typename CircAcqWide<T>::type W;
+	uint64_t across = (cols + block_cols - 1) / block_cols;
+	uint64_t down = (rows + block_rows - 1) / block_rows;
+	memset(bitmap, 0, sizeof(uint64_t) * ((across * down + 63) / 64));
+	long changed = 0;
+	for (uint64_t i = 0; i < down; i++)
+	{
+		std::fill(row, row + across, (W)0);
+		uint64_t r_end = std::min(rows, (i + 1) * block_rows);
+		for (uint64_t r = i * block_rows; r < r_end; r++)
+		{
+			const T* pa = a + r * cols;
+			const T* pb = b + r * cols;
+			for (uint64_t j = 0; j < across; j++)
+			{
+				uint64_t c_end = std::min(cols, (j + 1) * block_cols);
+				W sum = 0;
+				for (uint64_t c = j * block_cols; c < c_end; c++)
+				{
+					W d = (W)pa[c] - (W)pb[c];
+					sum += d < 0 ? -d : d;
+				}
+				row[j] += sum;
+			}
+		}
+		uint64_t h = r_end - i * block_rows;
+		for (uint64_t j = 0; j < across; j++)
+		{
+			uint64_t w = std::min(cols, (j + 1) * block_cols) - j * block_cols;
+			if ((double)row[j] > threshold * (double)(h * w))
+			{
+				uint64_t bit = i * across + j;
+				bitmap[bit / 64] |= (uint64_t)1 << (bit % 64);
+				changed++;
+			}
+		}
+	}
+	return changed;
+}
+
+template <typename T>
+inline void circacq_accumulate(const T* src, typename CircAcqWide<T>::type* acc, uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++)
+	{
+		acc[i] += src[i];
+	}
+}
+
+// dst = (src - offset) * gain, saturating for integer types
+template <typename T>
+inline void circacq_correct(const T* src, T* dst, const float* offset, const float* gain, uint64_t n)
+{
+	uint64_t i = 0;
+#ifdef CIRCACQ_SSE2
+	if (std::is_same<T, uint16_t>::value)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i bias = _mm_set1_epi32(32768);
+		const __m128i flip = _mm_set1_epi16((short)0x8000);
+		const __m128 hi = _mm_set1_ps(65535.0f);
+		const __m128 lo = _mm_setzero_ps();
+		for (; i + 8 <= n; i += 8)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+			__m128 a = _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero));
+			__m128 b = _mm_cvtepi32_ps(_mm_unpackhi_epi16(x, zero));
+			a = _mm_mul_ps(_mm_sub_ps(a, _mm_loadu_ps(offset + i)), _mm_loadu_ps(gain + i));
+			b = _mm_mul_ps(_mm_sub_ps(b, _mm_loadu_ps(offset + i + 4)), _mm_loadu_ps(gain + i + 4));
+			a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+			b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+			// SSE2 only packs with signed saturation, so shift into int16 range and back
+			__m128i ia = _mm_sub_epi32(_mm_cvtps_epi32(a), bias);
+			__m128i ib = _mm_sub_epi32(_mm_cvtps_epi32(b), bias);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_packs_epi32(ia, ib), flip));
+		}
+	}
+#endif
+	for (; i < n; i++)
+	{
+		dst[i] = circacq_saturate<T>(((float)src[i] - offset[i]) * gain[i]);
+	}
+}
+
+// Transposes rows [r0, r1) and columns [c0, c1) of a rows x cols frame
+template <typename T>
+inline void circacq_transpose_block(const T* src, T* dst, uint64_t rows, uint64_t cols, uint64_t r0, uint64_t r1, uint64_t c0, uint64_t c1)
+{
+	uint64_t r = r0;
+#ifdef CIRCACQ_SSE2
+	const uint64_t m = sizeof(T) == 2 ? 8 : sizeof(T) == 4 ? 4 : 0;  // Register tile edge
+	if (m > 0)
+	{
+		for (; r + m <= r1; r += m)
+		{
+			uint64_t c = c0;
+			for (; c + m <= c1; c += m)
+			{
+				if (m == 8)
+				{
+					circacq_transpose8x8_16(src + r * cols + c, cols, dst + c * rows + r, rows);
+				}
+				else
+				{
+					circacq_transpose4x4_32(src + r * cols + c, cols, dst + c * rows + r, rows);
+				}
+			}
+			for (; c < c1; c++)
+			{
+				for (uint64_t i = r; i < r + m; i++)
+				{
+					dst[c * rows + i] = src[i * cols + c];
+				}
+			}
+		}
+	}
+#endif
+	for (; r < r1; r++)
+	{
+		for (uint64_t c = c0; c < c1; c++)
+		{
+			dst[c * rows + r] = src[r * cols + c];
+		}
+	}
+}
+
+// Writes the rows x cols frame src to dst in column-major order
+template <typename T>
+inline void circacq_transpose(const T* src, T* dst, uint64_t rows, uint64_t cols)
+{
+	const uint64_t b = CIRCACQ_TRANSPOSE_BLOCK;
+	for (uint64_t r = 0; r < rows; r += b)
+	{
+		for (uint64_t c = 0; c < cols; c += b)
+		{
+			circacq_transpose_block(src, dst, rows, cols, r, std::min(r + b, rows), c, std::min(c + b, cols));
+		}
+	}
+}
+
+/*
+Writes the rows x cols frame src to dst as tile_rows x tile_cols tiles, each stored contiguously in row-major
+order, with the tiles themselves in row-major order. rows and cols must be multiples of the tile size.
+*/
+template <typename T>
+inline void circacq_tile(const T* src, T* dst, uint64_t rows, uint64_t cols, uint64_t tile_rows, uint64_t tile_cols)
+{
+	for (uint64_t tr = 0; tr < rows; tr += tile_rows)
+	{
+		for (uint64_t tc = 0; tc < cols; tc += tile_cols)
+		{
+			for (uint64_t r = tr; r < tr + tile_rows; r++)
+			{
+				memcpy(dst, src + r * cols + tc, sizeof(T) * tile_cols);
+				dst += tile_cols;
+			}
+		}
+	}
+}
+
+/*
+Splits samples interleaved groups of channels elements, src[s * channels + c], into one array per channel,
+dst[c][s]. Where SSE2 is available, 16-bit elements in multiples of 8 channels and 32-bit elements in
+multiples of 4 are shuffled in registers, 8x8 or 4x4 at a time.
+*/
+template <typename T>
+inline void circacq_deinterleave(const T* src, T* const* dst, int channels, uint64_t samples)
+{
+	uint64_t s = 0;
+#ifdef CIRCACQ_SSE2
+	if (sizeof(T) == 2 && channels % 8 == 0)
+	{
+		for (; s + 8 <= samples; s += 8)
+		{
+			for (int g = 0; g < channels; g += 8)
+			{
+				__m128i r[8];
+				for (int i = 0; i < 8; i++)
+				{
+					r[i] = _mm_loadu_si128((const __m128i*)(src + (s + i) * channels + g));
+				}
+				circacq_unpack8x8_16(r);
+				for (int c = 0; c < 8; c++)
+				{
+					_mm_storeu_si128((__m128i*)(dst[g + c] + s), r[c]);
+				}
+			}
+		}
+	}
+	else if (sizeof(T) == 4 && channels % 4 == 0)
+	{
+		for (; s + 4 <= samples; s += 4)
+		{
+			for (int g = 0; g < channels; g += 4)
+			{
+				__m128i r[4];
+				for (int i = 0; i < 4; i++)
+				{
+					r[i] = _mm_loadu_si128((const __m128i*)(src + (s + i) * channels + g));
+				}
+				circacq_unpack4x4_32(r);
+				for (int c = 0; c < 4; c++)
+				{
+					_mm_storeu_si128((__m128i*)(dst[g + c] + s), r[c]);
+				}
+			}
+		}
+	}
+#endif
+	for (; s < samples; s++)
+	{
+		for (int c = 0; c < channels; c++)
+		{
+			dst[c][s] = src[s * channels + c];
+		}
+	}
+}
@@ -0,0 +1,181 @@
+#pragma once
+#include "CircAcqBuffer.h"
+#include <climits>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/*
+Reads several CircAcqBuffers as a single stream ordered by element timestamp.
+
+Each ring contributes its next unread element to a min-heap keyed on timestamp. An element is only yielded
+once no ring can still produce an earlier one: either every ring has an element waiting, or the rings with
+nothing new have already published an element at or after its timestamp, so anything they publish next is
+later. If neither happens within the timeout the earliest waiting element is yielded anyway so that a
+stalled ring can't stop the others, unless a ring has published its next element but another consumer has it
+locked out: its timestamp is unknown until it is released, so next() times out instead. Timestamps are assumed to increase within each ring. While waiting,
+next() polls the rings with a short sleep rather than spinning.
+
+Elements are locked out of their ring, not copied, and stay locked out until the next call to next() or
+release(). Elements overwritten before they could be read are skipped, as with lock_out().
+
+github.com/sstucker
+2021
+*/
+
+template <class T>
+class CircAcqMergedReader
+{
+protected:
+
+	struct Pending
+	{
+		int64_t timestamp;
+		int ring;
+		long n;
+
+		bool operator>(const Pending& other) const
+		{
+			return timestamp > other.timestamp || (timestamp == other.timestamp && ring > other.ring);
+		}
+	};
+
+	std::vector<CircAcqBuffer<T>*> rings;
+	std::vector<long> next_n;  // Next count to read from each ring
+	std::vector<bool> queued;  // Whether each ring has an element in the heap
+	std::vector<int64_t> quiet_after;  // For rings with nothing queued, a timestamp they have already published, so anything new comes after it
+	std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> heap;
+	int held;  // Ring holding the current lock out, -1 if none
+	int64_t held_timestamp;
+	bool held_elsewhere;  // Whether the last _poll() found a ring's next element locked out by another consumer
+
+	/*
+	Queues the next element of each ring that has one available. Returns true once the earliest queued element
+	can be yielded because no ring with nothing queued can publish anything earlier.
+	*/
+	inline bool _poll()
+	{
+		int64_t bound = INT64_MAX;
+		held_elsewhere = false;
+		for (int r = 0; r < (int)rings.size(); r++)
+		{
+			if (queued[r])
+			{
+				continue;
+			}
+			long published = rings[r]->get_count();
+			int64_t newest_timestamp;
+			long newest = rings[r]->peek(published, &newest_timestamp);  // Read before peeking at next_n so anything published after is later
+			int64_t timestamp;
+			long n = rings[r]->peek((int)next_n[r], &timestamp);
+			if (n >= next_n[r])  // Available, or overwritten by n which is the one lock_out() would return
+			{
+				heap.push({ timestamp, r, n });
+				queued[r] = true;
+				continue;
+			}
+			if (published >= next_n[r])  // Published but locked out by another consumer, or mid-push
+			{
+				held_elsewhere = true;
+				bound = INT64_MIN;
+				continue;
+			}
+			if (newest >= 0)
+			{
+				quiet_after[r] = std::max(quiet_after[r], newest_timestamp);
+			}
+			bound = std::min(bound, quiet_after[r]);
+		}
+		return !heap.empty() && heap.top().timestamp <= bound;
+	}
+
+public:
+
+	CircAcqMergedReader()
+	{
+		held = -1;
+		held_timestamp = -1;
+		held_elsewhere = false;
+	}
+
+	// Returns the ring's index in the merged stream. Reading starts from element start
+	int add(CircAcqBuffer<T>* ring, long start = 0)
+	{
+		rings.push_back(ring);
+		next_n.push_back(start);
+		queued.push_back(false);
+		quiet_after.push_back(INT64_MIN);
+		return (int)rings.size() - 1;
+	}
+
+	/*
+	Locks out the next element in timestamp order, releasing the previous one. Returns its count in its own
+	ring, or a CircAcqStatus if nothing was available within timeout_ms. If the earliest element can't be
+	locked out in time, e.g. because another consumer holds its ring's lock out, it stays queued and
+	CIRCACQ_TIMED_OUT is returned rather than yielding a later element of another ring ahead of it.
+	*/
+	long next(T** buffer, int timeout_ms)
+	{
+		release();
+		auto start = clk::now();
+		int timeout_us = timeout_ms * 1000;
+		while (!_poll() && std::chrono::duration_cast<us>(clk::now() - start).count() <= timeout_us)
+		{
+			std::this_thread::sleep_for(us(50));
+		}
+		if (held_elsewhere)
+		{
+			return CIRCACQ_TIMED_OUT;
+		}
+		while (!heap.empty())
+		{
+			Pending p = heap.top();
+			long locked_out = rings[p.ring]->lock_out((int)p.n, buffer, timeout_ms);
+			if (locked_out < 0)
+			{
+				return locked_out;  // Still queued, so the next call retries it before anything later
+			}
+			heap.pop();
+			int64_t timestamp = rings[p.ring]->get_locked_out_timestamp();
+			if (locked_out != p.n && !heap.empty() && timestamp > heap.top().timestamp)
+			{
+				// Overwritten by a later element than the one queued; queue that one in its place
+				rings[p.ring]->release();
+				heap.push({ timestamp, p.ring, locked_out });
+				continue;
+			}
+			queued[p.ring] = false;
+			next_n[p.ring] = locked_out + 1;
+			held = p.ring;
+			held_timestamp = timestamp;
+			return locked_out;
+		}
+		return CIRCACQ_TIMED_OUT;
+	}
+
+	// Index of the ring the current element was locked out of, -1 if none
+	int current_ring()
+	{
+		return held;
+	}
+
+	int64_t current_timestamp()
+	{
+		return held_timestamp;
+	}
+
+	void release()
+	{
+		if (held != -1)
+		{
+			rings[held]->release();
+			held = -1;
+		}
+	}
+
+	~CircAcqMergedReader()
+	{
+		release();
+	}
+
+};
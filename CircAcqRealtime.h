@@ -0,0 +1,148 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX  // Keep windows.h's min and max macros from breaking std::min and std::max
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+/*
+Real-time thread configuration helpers for CircAcqBuffer producers and consumers.
+
+Each helper acts on the calling thread (or process, for memory locking) and returns 0 on success or -1
+if the OS refused, printing why. Refusal is expected without privileges (CAP_SYS_NICE / RLIMIT_RTPRIO and
+RLIMIT_MEMLOCK on Linux), in which case the thread keeps running with its default configuration.
+
+circacq_measure_sched_latency() runs a calibration loop in the calling thread: it repeatedly sleeps until
+a deadline and records how late it woke up, which is the jitter a producer sees on top of its own work.
+
+github.com/sstucker
+2021
+*/
+
+struct CircAcqThreadConfig
+{
+	int core = -1;  // Core to pin to, -1 to leave affinity alone
+	int priority = 0;  // SCHED_FIFO priority 1-99, 0 to leave the scheduling policy alone
+};
+
+struct CircAcqSchedLatency
+{
+	long samples;
+	int64_t p50_us;
+	int64_t p99_us;
+	int64_t p999_us;
+	int64_t max_us;
+};
+
+inline int circacq_pin_thread(int core)
+{
+#ifdef _WIN32
+	if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core) == 0)
+	{
+		printf("CircAcqRealtime: Failed to pin thread to core %i (error %lu).\n", core, GetLastError());
+		return -1;
+	}
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err != 0)
+	{
+		printf("CircAcqRealtime: Failed to pin thread to core %i: %s\n", core, strerror(err));
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+inline int circacq_set_realtime_priority(int priority)
+{
+#ifdef _WIN32
+	// Windows has no SCHED_FIFO; time critical is the closest a thread can ask for without a realtime process class
+	if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+	{
+		printf("CircAcqRealtime: Failed to raise thread priority (error %lu).\n", GetLastError());
+		return -1;
+	}
+#else
+	sched_param param;
+	param.sched_priority = std::min(std::max(priority, sched_get_priority_min(SCHED_FIFO)), sched_get_priority_max(SCHED_FIFO));
+	int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err != 0)
+	{
+		printf("CircAcqRealtime: Failed to set SCHED_FIFO priority %i: %s\n", param.sched_priority, strerror(err));
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+inline int circacq_lock_memory()
+{
+#ifdef _WIN32
+	printf("CircAcqRealtime: Locking process memory is not supported on Windows.\n");
+	return -1;
+#else
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	{
+		printf("CircAcqRealtime: Failed to lock memory: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+// Returns the number of settings that couldn't be applied
+inline int circacq_apply_thread_config(CircAcqThreadConfig config)
+{
+	int failed = 0;
+	if (config.core >= 0)
+	{
+		failed -= circacq_pin_thread(config.core);
+	}
+	if (config.priority > 0)
+	{
+		failed -= circacq_set_realtime_priority(config.priority);
+	}
+	return failed;
+}
+
+inline CircAcqSchedLatency circacq_measure_sched_latency(int duration_ms, int period_us)
+{
+	typedef std::chrono::steady_clock steady;
+	std::vector<int64_t> late;
+	late.reserve((size_t)duration_ms * 1000 / (std::max)(period_us, 1) + 1);  // Parenthesized in case windows.h was included before this without NOMINMAX
+	auto end = steady::now() + std::chrono::milliseconds(duration_ms);
+	auto deadline = steady::now();
+	while (deadline < end)
+	{
+		deadline += std::chrono::microseconds(period_us);
+		std::this_thread::sleep_until(deadline);
+		late.push_back(std::chrono::duration_cast<std::chrono::microseconds>(steady::now() - deadline).count());
+	}
+	CircAcqSchedLatency result = { (long)late.size(), 0, 0, 0, 0 };
+	if (!late.empty())
+	{
+		std::sort(late.begin(), late.end());
+		result.p50_us = late[(late.size() - 1) / 2];
+		result.p99_us = late[(size_t)((late.size() - 1) * 0.99)];
+		result.p999_us = late[(size_t)((late.size() - 1) * 0.999)];
+		result.max_us = late.back();
+	}
+	return result;
+}
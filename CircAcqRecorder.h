@@ -0,0 +1,362 @@
+#pragma once
+#include "CircAcqBuffer.h"
+#include "CircAcqCodec.h"
+#include "CircAcqRecording.h"
+#include <cerrno>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+/*
+Recording consumer that compresses frames on several threads and writes them to disk in count order.
+
+A reader thread locks out every element of the ring in order as a registered consumer ("recorder") and copies
+it into one of a pool of jobs, releasing the lock out straight away. N compression threads code the jobs with
+circacq_encode() (see CircAcqCodec.h) in parallel, and a writer thread writes them out strictly in count
+order, so the file is written sequentially. If compression or the disk can't keep up, the pool fills, the
+reader falls behind and the ring's consumer statistics show the skipped frames.
+
+The file is a chunked recording with a footer index, written by stop(); see CircAcqRecording.h. If a write
+fails, e.g. because the disk is full, recording stops and get_stats() reports the failure. stop() still has
+to be called to close the file, which is left without an index so that CircAcqRecordingReader rebuilds it
+from the chunks written whole.
+
+get_stats() reports frames written and dropped, the compression ratio and the sustained frame rate.
+
+github.com/sstucker
+2021
+*/
+
+struct CircAcqRecorderStats
+{
+	long frames;  // Written to disk
+	long dropped;  // Overwritten in the ring before the recorder could lock them out
+	uint64_t raw_bytes;
+	uint64_t coded_bytes;
+	double ratio;  // raw_bytes / coded_bytes
+	double fps;  // Frames written per second since start()
+	bool failed;  // A write to the file failed and recording stopped
+};
+
+template <class T>
+class CircAcqRecorder
+{
+protected:
+
+	enum JobState { FREE, FILLED, CODING, CODED };
+
+	struct Job
+	{
+		std::vector<T> raw;
+		std::vector<uint8_t> coded;
+		CircAcqRecordHeader header;
+		JobState state;
+	};
+
+	CircAcqBuffer<T>* ring;
+	FILE* file;
+	int consumer;
+	int n_threads;  // Compression threads
+	std::vector<Job> jobs;  // Frame of sequence number s in jobs[s % jobs.size()]
+	std::vector<std::thread> threads;
+	std::mutex jobs_lock;
+	std::condition_variable jobs_changed;
+	long first;  // Count of the first element to record
+	long filled;  // Sequence numbers handed to jobs so far
+	long next_coded;  // Next sequence number for a compression thread
+	std::atomic_bool running;
+	std::atomic_bool stopped;  // The reader has stopped; drain what was filled
+	std::atomic_bool failed;  // A write failed; the rest of what was filled is discarded
+	std::atomic_long frames;
+	std::atomic_long dropped;
+	std::atomic<uint64_t> raw_bytes;
+	std::atomic<uint64_t> coded_bytes;
+	uint64_t offset;  // Of the next chunk in the file
+	std::vector<CircAcqIndexEntry> index;  // Only touched by the writer thread until it has finished
+	std::chrono::time_point<clk> start_time;
+	std::chrono::time_point<clk> stop_time;
+
+	void _read()
+	{
+		uint64_t n = ring->get_element_size();
+		long next = first;
+		long seq = 0;
+		T* p;
+		while (running.load())
+		{
+			if (next > ring->get_count())
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+				continue;
+			}
+			Job& job = jobs[seq % jobs.size()];
+			{
+				std::unique_lock<std::mutex> guard(jobs_lock);
+				jobs_changed.wait(guard, [&]() { return job.state == FREE || !running.load(); });
+			}
+			if (!running.load())
+			{
+				break;
+			}
+			long got = ring->lock_out((int)next, &p, 100, consumer);
+			if (got == CIRCACQ_SHUTDOWN)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));  // Returns straight away until the ring is cleared
+				continue;
+			}
+			if (got < 0)
+			{
+				continue;
+			}
+			memcpy(job.raw.data(), p, sizeof(T) * n);
+			job.header.timestamp = ring->get_locked_out_timestamp();
+			ring->release();
+			job.header.count = got;
+			dropped += got - next;
+			next = got + 1;
+			{
+				std::lock_guard<std::mutex> guard(jobs_lock);
+				job.state = FILLED;
+				filled = ++seq;
+			}
+			jobs_changed.notify_all();
+		}
+		{
+			std::lock_guard<std::mutex> guard(jobs_lock);  // Under the lock so a waiter can't miss the notify between its check and its wait
+			stopped.store(true);
+		}
+		jobs_changed.notify_all();
+	}
+
+	void _compress()
+	{
+		uint64_t n = ring->get_element_size();
+		while (true)
+		{
+			Job* job;
+			{
+				std::unique_lock<std::mutex> guard(jobs_lock);
+				jobs_changed.wait(guard, [&]() { return next_coded < filled || stopped.load(); });
+				if (next_coded >= filled)
+				{
+					return;
+				}
+				job = &jobs[next_coded++ % jobs.size()];
+				job->state = CODING;
+			}
+			job->header.size = circacq_encode(job->raw.data(), n, job->coded.data());
+			job->header.checksum = circacq_crc32(job->coded.data(), job->header.size);
+			job->header.reserved = 0;
+			{
+				std::lock_guard<std::mutex> guard(jobs_lock);
+				job->state = CODED;
+			}
+			jobs_changed.notify_all();
+		}
+	}
+
+	void _write()
+	{
+		uint64_t n = ring->get_element_size();
+		long seq = 0;
+		while (true)
+		{
+			Job& job = jobs[seq % jobs.size()];
+			{
+				std::unique_lock<std::mutex> guard(jobs_lock);
+				jobs_changed.wait(guard, [&]() { return (seq < filled && job.state == CODED) || (stopped.load() && seq >= filled); });
+				if (seq >= filled)
+				{
+					return;
+				}
+			}
+			if (!failed.load())
+			{
+				if (fwrite(&job.header, sizeof(job.header), 1, file) != 1 || fwrite(job.coded.data(), 1, job.header.size, file) != job.header.size)
+				{
+					printf("CircAcqRecorder: Failed to write frame %lld: %s\n", (long long)job.header.count, strerror(errno));
+					failed.store(true);
+				}
+				else
+				{
+					index.push_back({ job.header.count, job.header.timestamp, offset, job.header.size, job.header.checksum, 0 });
+					offset += sizeof(job.header) + job.header.size;
+					raw_bytes += sizeof(T) * n;
+					coded_bytes += sizeof(job.header) + job.header.size;
+					frames += 1;
+				}
+			}
+			{
+				std::lock_guard<std::mutex> guard(jobs_lock);
+				job.state = FREE;
+				if (failed.load() && running.load())
+				{
+					stop_time = clk::now();
+					running.store(false);  // Stop the reader; stop() still joins the threads and closes the file
+				}
+			}
+			jobs_changed.notify_all();
+			seq++;
+		}
+	}
+
+public:
+
+	// Jobs in flight default to twice the number of compression threads
+	CircAcqRecorder(CircAcqBuffer<T>* buffer, int compression_threads, int pool_size = 0)
+	{
+		ring = buffer;
+		file = NULL;
+		consumer = -1;
+		n_threads = compression_threads > 0 ? compression_threads : 1;
+		jobs = std::vector<Job>(pool_size > 0 ? pool_size : 2 * n_threads);
+		for (Job& job : jobs)
+		{
+			job.raw.resize(ring->get_element_size());
+			job.coded.resize(circacq_encode_bound<T>(ring->get_element_size()));
+			job.state = FREE;
+		}
+		first = 0;
+		filled = 0;
+		next_coded = 0;
+		running = ATOMIC_VAR_INIT(false);
+		stopped = ATOMIC_VAR_INIT(true);
+		failed = ATOMIC_VAR_INIT(false);
+		frames = ATOMIC_VAR_INIT(0);
+		dropped = ATOMIC_VAR_INIT(0);
+		raw_bytes = ATOMIC_VAR_INIT(0);
+		coded_bytes = ATOMIC_VAR_INIT(0);
+		offset = 0;
+		start_time = clk::now();
+		stop_time = start_time;
+	}
+
+	/*
+	Records elements published from now on to path until stop(). Returns 0, or -1 if the file can't be opened
+	or the ring has no room for another consumer.
+	*/
+	int start(const char* path)
+	{
+		if (file != NULL)
+		{
+			return -1;
+		}
+		file = fopen(path, "wb");
+		if (file == NULL)
+		{
+			printf("CircAcqRecorder: Can't open %s for writing.\n", path);
+			return -1;
+		}
+		setvbuf(file, NULL, _IOFBF, 1 << 22);
+		CircAcqRecordingHeader header = { CIRCACQ_RECORDING_MAGIC, CIRCACQ_RECORDING_VERSION, (uint32_t)sizeof(T), 0, ring->get_element_size() };
+		if (fwrite(&header, sizeof(header), 1, file) != 1)
+		{
+			printf("CircAcqRecorder: Failed to write to %s: %s\n", path, strerror(errno));
+			fclose(file);
+			file = NULL;
+			return -1;
+		}
+		offset = sizeof(header);
+		index.clear();
+		if (consumer == -1)
+		{
+			consumer = ring->register_consumer(0, 0, nullptr, "recorder");
+		}
+		if (consumer == -1)
+		{
+			printf("CircAcqRecorder: Can't register as a consumer of the ring.\n");
+			fclose(file);
+			file = NULL;
+			return -1;
+		}
+		for (Job& job : jobs)
+		{
+			job.state = FREE;
+		}
+		first = ring->get_count() + 1;
+		filled = 0;
+		next_coded = 0;
+		frames.store(0);
+		dropped.store(0);
+		failed.store(false);
+		raw_bytes.store(0);
+		coded_bytes.store(0);
+		start_time = clk::now();
+		stopped.store(false);
+		running.store(true);
+		threads.push_back(std::thread(&CircAcqRecorder::_read, this));
+		for (int i = 0; i < n_threads; i++)
+		{
+			threads.push_back(std::thread(&CircAcqRecorder::_compress, this));
+		}
+		threads.push_back(std::thread(&CircAcqRecorder::_write, this));
+		return 0;
+	}
+
+	// Stops reading, writes out the frames already read and the index, and closes the file
+	void stop()
+	{
+		if (file == NULL)
+		{
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(jobs_lock);
+			if (running.load())
+			{
+				stop_time = clk::now();  // Refined once the threads have drained
+			}
+			running.store(false);
+		}
+		jobs_changed.notify_all();
+		for (std::thread& t : threads)
+		{
+			t.join();
+		}
+		threads.clear();
+		ring->unregister_consumer(consumer);  // A stopped recorder must not hold back the ring's overflow area
+		consumer = -1;
+		if (!failed.load())  // After a failed write, stop_time is when the writer gave up
+		{
+			std::lock_guard<std::mutex> guard(jobs_lock);
+			stop_time = clk::now();
+		}
+		bool written = !failed.load();
+		if (written)
+		{
+			CircAcqRecordingTrailer trailer = { offset, index.size(), CIRCACQ_RECORDING_MAGIC, 0 };
+			written = fwrite(index.data(), sizeof(CircAcqIndexEntry), index.size(), file) == index.size() && fwrite(&trailer, sizeof(trailer), 1, file) == 1;
+		}
+		if ((fclose(file) != 0 || !written) && !failed.load())  // A failed frame was already reported
+		{
+			printf("CircAcqRecorder: Failed to write the index: %s\n", strerror(errno));
+			failed.store(true);
+		}
+		file = NULL;
+	}
+
+	CircAcqRecorderStats get_stats()
+	{
+		CircAcqRecorderStats stats;
+		stats.frames = frames.load();
+		stats.dropped = dropped.load();
+		stats.raw_bytes = raw_bytes.load();
+		stats.coded_bytes = coded_bytes.load();
+		stats.ratio = stats.coded_bytes > 0 ? (double)stats.raw_bytes / stats.coded_bytes : 0;
+		std::chrono::time_point<clk> end;
+		{
+			std::lock_guard<std::mutex> guard(jobs_lock);  // stop_time is set with running cleared, by stop() or by the writer after a failed write
+			end = running.load() ? clk::now() : stop_time;
+		}
+		double seconds = std::chrono::duration_cast<us>(end - start_time).count() / 1e6;
+		stats.fps = seconds > 0 ? stats.frames / seconds : 0;
+		stats.failed = failed.load();
+		return stats;
+	}
+
+	~CircAcqRecorder()
+	{
+		stop();
+	}
+
+};
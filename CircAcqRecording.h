@@ -0,0 +1,327 @@
+#pragma once
+#include "CircAcqBuffer.h"
+#include "CircAcqCodec.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+/*
+Recording files written by CircAcqRecorder, and CircAcqRecordingReader to read them back.
+
+File layout: a CircAcqRecordingHeader, then one chunk per frame in count order (a CircAcqRecordHeader and the
+samples coded by circacq_encode()), then a footer index with a CircAcqIndexEntry per chunk and finally a
+CircAcqRecordingTrailer locating the index. The trailer is written last, when recording stops; chunks are
+self-describing so a file cut short by a crash is still read, by walking the chunks to rebuild the index up
+to the first chunk that is cut short or fails its CRC.
+
+CircAcqRecordingReader maps the file and finds frames by count or timestamp with a binary search of the
+index, which is copied out of the mapping as chunks leave it unaligned. read() decodes a frame after checking
+that its chunk lies within the file, its CRC-32 and that it codes a whole frame, and replay() feeds a range
+of frames back into a CircAcqBuffer with their original timestamps, optionally paced like the original acquisition.
+
+POSIX only for now.
+
+github.com/sstucker
+2021
+*/
+
+#define CIRCACQ_RECORDING_MAGIC 0x52514143  // "CAQR"
+#define CIRCACQ_RECORDING_VERSION 2
+
+struct CircAcqRecordingHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sample_size;  // sizeof(T)
+	uint32_t reserved;
+	uint64_t element_size;
+};
+
+struct CircAcqRecordHeader
+{
+	int64_t count;
+	int64_t timestamp;
+	uint64_t size;  // Bytes of coded samples that follow
+	uint32_t checksum;  // CRC-32 of the coded samples
+	uint32_t reserved;
+};
+
+struct CircAcqIndexEntry
+{
+	int64_t count;
+	int64_t timestamp;
+	uint64_t offset;  // Of the chunk's CircAcqRecordHeader from the start of the file
+	uint64_t size;  // Bytes of coded samples
+	uint32_t checksum;
+	uint32_t reserved;
+};
+
+struct CircAcqRecordingTrailer
+{
+	uint64_t index_offset;
+	uint64_t entries;
+	uint32_t magic;
+	uint32_t reserved;
+};
+
+// CRC-32 (IEEE 802.3), continuing from crc
+inline uint32_t circacq_crc32(const void* data, uint64_t n, uint32_t crc = 0)
+{
+	static const struct Table
+	{
+		uint32_t t[256];
+		Table()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+				{
+					c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				}
+				t[i] = c;
+			}
+		}
+	} table;
+	const uint8_t* p = (const uint8_t*)data;
+	crc = ~crc;
+	for (uint64_t i = 0; i < n; i++)
+	{
+		crc = table.t[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#ifndef _WIN32
+
+template <class T>
+class CircAcqRecordingReader
+{
+protected:
+
+	void* map;
+	size_t length;
+	const CircAcqRecordingHeader* header;
+	const CircAcqIndexEntry* index;
+	uint64_t entries;
+	std::vector<CircAcqIndexEntry> table;  // Index copied from the footer, or rebuilt from the chunks if the file has no trailer
+
+	// Coded samples of the chunk e points to, or NULL if it lies outside the file, fails its CRC or doesn't code a whole frame
+	inline const uint8_t* _coded(const CircAcqIndexEntry& e)
+	{
+		if (e.offset < sizeof(CircAcqRecordingHeader) || e.offset > length || length - e.offset < sizeof(CircAcqRecordHeader)
+			|| e.size > length - e.offset - sizeof(CircAcqRecordHeader))
+		{
+			return NULL;
+		}
+		const uint8_t* coded = (const uint8_t*)map + e.offset + sizeof(CircAcqRecordHeader);
+		if (circacq_crc32(coded, e.size) != e.checksum || !circacq_check_coded<T>(coded, e.size, header->element_size))
+		{
+			return NULL;
+		}
+		return coded;
+	}
+
+	// Walks the chunks of a file whose recording didn't stop cleanly, up to the last complete, intact one
+	void _recover()
+	{
+		uint64_t offset = sizeof(CircAcqRecordingHeader);
+		while (offset + sizeof(CircAcqRecordHeader) <= length)
+		{
+			CircAcqRecordHeader chunk;
+			memcpy(&chunk, (const char*)map + offset, sizeof(chunk));  // Chunks are packed back to back, so not aligned
+			if (chunk.size > length - offset - sizeof(CircAcqRecordHeader))
+			{
+				break;
+			}
+			CircAcqIndexEntry e = { chunk.count, chunk.timestamp, offset, chunk.size, chunk.checksum, 0 };
+			if (_coded(e) == NULL)  // Torn or garbage: its size can't be trusted to find the next chunk
+			{
+				printf("CircAcqRecordingReader: Stopping recovery at a chunk at %llu that fails its checksum.\n", (unsigned long long)offset);
+				break;
+			}
+			table.push_back(e);
+			offset += sizeof(CircAcqRecordHeader) + chunk.size;
+		}
+		index = table.data();
+		entries = table.size();
+	}
+
+public:
+
+	CircAcqRecordingReader()
+	{
+		map = NULL;
+		length = 0;
+		header = NULL;
+		index = NULL;
+		entries = 0;
+	}
+
+	// Returns 0 on success, -1 if the file can't be mapped or isn't a recording of T
+	int open(const char* path)
+	{
+		int fd = ::open(path, O_RDONLY);
+		if (fd == -1)
+		{
+			printf("CircAcqRecordingReader: Failed to open %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		struct stat st;
+		fstat(fd, &st);
+		length = (size_t)st.st_size;
+		map = length >= sizeof(CircAcqRecordingHeader) ? mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		::close(fd);
+		if (map == MAP_FAILED)
+		{
+			printf("CircAcqRecordingReader: Failed to map %s.\n", path);
+			map = NULL;
+			return -1;
+		}
+		header = (const CircAcqRecordingHeader*)map;
+		if (header->magic != CIRCACQ_RECORDING_MAGIC || header->version != CIRCACQ_RECORDING_VERSION || header->sample_size != sizeof(T))
+		{
+			printf("CircAcqRecordingReader: %s is not a recording of %i byte elements.\n", path, (int)sizeof(T));
+			close();
+			return -1;
+		}
+		CircAcqRecordingTrailer trailer = {};
+		if (length >= sizeof(CircAcqRecordingHeader) + sizeof(CircAcqRecordingTrailer))
+		{
+			memcpy(&trailer, (const char*)map + length - sizeof(trailer), sizeof(trailer));  // Follows the chunks, so not aligned
+		}
+		uint64_t room = length - sizeof(CircAcqRecordingTrailer);  // Bytes the index may take up, once the trailer is known to fit
+		if (trailer.magic == CIRCACQ_RECORDING_MAGIC && trailer.entries <= room / sizeof(CircAcqIndexEntry)
+			&& trailer.index_offset >= sizeof(CircAcqRecordingHeader) && trailer.index_offset <= room - trailer.entries * sizeof(CircAcqIndexEntry)
+			&& trailer.index_offset + trailer.entries * sizeof(CircAcqIndexEntry) == room)
+		{
+			table.resize(trailer.entries);
+			memcpy(table.data(), (const char*)map + trailer.index_offset, trailer.entries * sizeof(CircAcqIndexEntry));
+			index = table.data();
+			entries = table.size();
+		}
+		else
+		{
+			printf("CircAcqRecordingReader: %s has no index, rebuilding it from the chunks.\n", path);
+			_recover();
+		}
+		return 0;
+	}
+
+	uint64_t get_element_size()
+	{
+		return header->element_size;
+	}
+
+	// Number of frames recorded
+	long frames()
+	{
+		return (long)entries;
+	}
+
+	const CircAcqIndexEntry& entry(long i)
+	{
+		return index[i];
+	}
+
+	// Index of the frame of count n, or -1 if it wasn't recorded
+	long find(long n)
+	{
+		const CircAcqIndexEntry* it = std::lower_bound(index, index + entries, (int64_t)n, [](const CircAcqIndexEntry& e, int64_t c) { return e.count < c; });
+		return it != index + entries && it->count == n ? (long)(it - index) : -1;
+	}
+
+	// Index of the first frame stamped at or after timestamp, or frames() if there is none
+	long find_time(int64_t timestamp)
+	{
+		const CircAcqIndexEntry* it = std::lower_bound(index, index + entries, timestamp, [](const CircAcqIndexEntry& e, int64_t t) { return e.timestamp < t; });
+		return (long)(it - index);
+	}
+
+	// Decodes the i-th frame into dst. Returns its count, or -1 if i is out of range or the chunk is corrupt
+	long read(long i, T* dst, int64_t* timestamp = NULL)
+	{
+		if (i < 0 || (uint64_t)i >= entries)
+		{
+			return -1;
+		}
+		const CircAcqIndexEntry& e = index[i];
+		const uint8_t* coded = _coded(e);
+		if (coded == NULL)
+		{
+			printf("CircAcqRecordingReader: Frame %lld is outside the file or corrupt.\n", (long long)e.count);
+			return -1;
+		}
+		circacq_decode(coded, header->element_size, dst);
+		if (timestamp != NULL)
+		{
+			*timestamp = e.timestamp;
+		}
+		return (long)e.count;
+	}
+
+	/*
+	Pushes frames first to last (indices, inclusive) into buf, whose element size must match, decoding each
+	straight into the head slot and publishing it with its recorded timestamp. With speed > 0, frames are
+	paced by their timestamp differences divided by speed. Returns the number of frames replayed.
+	*/
+	long replay(CircAcqBuffer<T>& buf, long first, long last, double speed = 0)
+	{
+		if (buf.get_element_size() != header->element_size)
+		{
+			printf("CircAcqRecordingReader: Can't replay %llu element frames into a ring of %llu.\n", (unsigned long long)header->element_size, (unsigned long long)buf.get_element_size());
+			return 0;
+		}
+		first = std::max(first, 0L);
+		last = std::min(last, (long)entries - 1);
+		auto start = clk::now();
+		long replayed = 0;
+		for (long i = first; i <= last; i++)
+		{
+			const CircAcqIndexEntry& e = index[i];
+			if (speed > 0)
+			{
+				std::this_thread::sleep_until(start + us((int64_t)((e.timestamp - index[first].timestamp) / speed)));
+			}
+			const uint8_t* coded = _coded(e);
+			if (coded == NULL)
+			{
+				printf("CircAcqRecordingReader: Skipping frame %lld, which is outside the file or corrupt.\n", (long long)e.count);
+				continue;
+			}
+			circacq_decode(coded, header->element_size, buf.lock_out_head());
+			buf.release_head(e.timestamp);
+			replayed++;
+		}
+		return replayed;
+	}
+
+	void close()
+	{
+		if (map != NULL)
+		{
+			munmap(map, length);
+			map = NULL;
+		}
+		header = NULL;
+		index = NULL;
+		entries = 0;
+		table.clear();
+	}
+
+	~CircAcqRecordingReader()
+	{
+		close();
+	}
+
+};
+
+#endif
@@ -0,0 +1,112 @@
+#pragma once
+#include "CircAcqBuffer.h"
+#include "CircAcqMerge.h"
+#include <vector>
+
+/*
+Ring made of one CircAcqBuffer shard per producer, for ingest rates where a shared head would be contended.
+
+Each producer thread pushes only to its own shard (pin it to a core with CircAcqRealtime.h), so producers
+share no state at all. Consumers either read a shard directly or read every shard as one stream through
+reader(), which merges them in timestamp order.
+
+push() orders by each producer's clock reading at push time. push_sequenced() instead stamps elements with a
+strictly increasing global sequence number for when ties or clock resolution matter; it costs an atomic
+increment on a counter shared by all producers, so it gives up some of the scaling.
+
+github.com/sstucker
+2021
+*/
+
+template <class T>
+class CircAcqShardedBuffer
+{
+protected:
+
+	std::vector<CircAcqBuffer<T>*> shards;
+	alignas(64) std::atomic<int64_t> sequence;  // Only touched by push_sequenced()
+
+public:
+
+	CircAcqShardedBuffer(int number_of_shards, int buffers_per_shard, uint64_t frame_size)
+	{
+		for (int i = 0; i < number_of_shards; i++)
+		{
+			shards.push_back(new CircAcqBuffer<T>(buffers_per_shard, frame_size));
+		}
+		sequence = ATOMIC_VAR_INIT(0);
+	}
+
+	int push(int shard, T* src)
+	{
+		return shards[shard]->push(src);
+	}
+
+	int push(int shard, T* src, int64_t timestamp)
+	{
+		return shards[shard]->push(src, timestamp);
+	}
+
+	int push_sequenced(int shard, T* src)
+	{
+		return shards[shard]->push(src, sequence++);
+	}
+
+	CircAcqBuffer<T>* shard(int i)
+	{
+		return shards[i];
+	}
+
+	int get_shard_count()
+	{
+		return (int)shards.size();
+	}
+
+	// Total elements pushed across all shards
+	long get_count()
+	{
+		long total = 0;
+		for (CircAcqBuffer<T>* s : shards)
+		{
+			total += s->get_count() + 1;
+		}
+		return total;
+	}
+
+	// Reader over all shards in timestamp order, starting from each shard's next element
+	CircAcqMergedReader<T> reader()
+	{
+		CircAcqMergedReader<T> merged;
+		for (CircAcqBuffer<T>* s : shards)
+		{
+			merged.add(s, s->get_count() + 1);
+		}
+		return merged;
+	}
+
+	void shutdown()
+	{
+		for (CircAcqBuffer<T>* s : shards)
+		{
+			s->shutdown();
+		}
+	}
+
+	void clear()
+	{
+		for (CircAcqBuffer<T>* s : shards)
+		{
+			s->clear();
+		}
+		sequence.store(0);
+	}
+
+	~CircAcqShardedBuffer()
+	{
+		for (CircAcqBuffer<T>* s : shards)
+		{
+			delete s;
+		}
+	}
+
+};
@@ -0,0 +1,307 @@
+#pragma once
+#include "CircAcqBuffer.h"
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+/*
+Snapshots of a whole CircAcqBuffer on disk.
+
+circacq_save_snapshot() dumps every slot with its count and timestamp while acquisition continues: each
+slot is copied out under its own lock into an aligned staging buffer, so push() is only held up for one
+memcpy, then written with pwrite at an aligned offset by one of several writer threads (using O_DIRECT
+where the filesystem allows it). Slots overwritten during the dump are saved with their newer count. The
+element the last lock out swapped out of the ring is then copied under the claim and saved in its slot if
+that slot doesn't hold something newer. The ring's layout is saved too and set on the loaded buffer.
+
+CircAcqSnapshot maps a snapshot file and constructs a CircAcqBuffer directly around the mapped slots, so
+opening it copies nothing and the snapshot can be read with the usual lock_out() API; lock outs are swapped
+back into their slot on release, so any element can be read any number of times. The header is checked
+against the file before anything is mapped. The mapping is private: writes to the loaded buffer are never
+written back to the file.
+
+File layout: CircAcqSnapshotHeader, then a CircAcqSnapshotSlot per slot, padded to the alignment, then the
+slots themselves, each padded to the alignment.
+
+POSIX only for now.
+
+github.com/sstucker
+2021
+*/
+
+#define CIRCACQ_SNAPSHOT_MAGIC "CIRCACQS"
+#define CIRCACQ_SNAPSHOT_VERSION 2
+#define CIRCACQ_SNAPSHOT_ALIGNMENT 4096
+
+struct CircAcqSnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t element_bytes;  // sizeof(T)
+	uint64_t element_size;  // Elements per slot
+	int64_t ring_size;
+	int64_t newest;  // Count of the most recent element saved
+	uint64_t alignment;
+	uint64_t slot_bytes;  // Bytes between consecutive slots
+	uint64_t data_offset;  // Offset of the first slot
+	uint64_t layout_type;  // CircAcqLayout the elements were pushed with
+	uint64_t layout_rows;
+	uint64_t layout_cols;
+	uint64_t layout_tile_rows;
+	uint64_t layout_tile_cols;
+};
+
+struct CircAcqSnapshotSlot
+{
+	int64_t count;
+	int64_t timestamp;
+};
+
+inline uint64_t circacq_align(uint64_t n, uint64_t alignment)
+{
+	return (n + alignment - 1) / alignment * alignment;
+}
+
+#ifndef _WIN32
+
+// Returns 0 on success, -1 on failure, including if a lock out isn't released within timeout_ms
+template <class T>
+int circacq_save_snapshot(CircAcqBuffer<T>& buf, const char* path, int threads = 4, int timeout_ms = 1000)
+{
+	int ring_size = buf.get_ring_size();
+	uint64_t element_size = buf.get_element_size();
+	CircAcqSnapshotHeader header;
+	memcpy(header.magic, CIRCACQ_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = CIRCACQ_SNAPSHOT_VERSION;
+	header.element_bytes = sizeof(T);
+	header.element_size = element_size;
+	header.ring_size = ring_size;
+	header.alignment = CIRCACQ_SNAPSHOT_ALIGNMENT;
+	header.slot_bytes = circacq_align(sizeof(T) * element_size, header.alignment);
+	header.data_offset = circacq_align(sizeof(header) + sizeof(CircAcqSnapshotSlot) * ring_size, header.alignment);
+	CircAcqLayout layout = buf.get_layout();
+	header.layout_type = (uint64_t)layout.type;
+	header.layout_rows = layout.rows;
+	header.layout_cols = layout.cols;
+	header.layout_tile_rows = layout.tile_rows;
+	header.layout_tile_cols = layout.tile_cols;
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	int fd = open(path, flags | O_DIRECT, 0644);  // Bypass the page cache; everything below is aligned for it
+	if (fd == -1 && errno == EINVAL)
+	{
+		fd = open(path, flags, 0644);
+	}
+#else
+	int fd = open(path, flags, 0644);
+#endif
+	if (fd == -1)
+	{
+		printf("CircAcqSnapshot: Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	std::vector<CircAcqSnapshotSlot> slots(ring_size);
+	std::atomic_int failed(0);
+	threads = std::max(1, std::min(threads, ring_size));
+	std::vector<std::thread> writers;
+	for (int t = 0; t < threads; t++)
+	{
+		writers.emplace_back([&, t]()
+		{
+			void* staging = NULL;
+			if (posix_memalign(&staging, header.alignment, header.slot_bytes) != 0)
+			{
+				failed += 1;
+				return;
+			}
+			memset(staging, 0, header.slot_bytes);  // Padding is written too
+			for (int i = t; i < ring_size; i += threads)
+			{
+				slots[i].count = buf.copy_slot(i, (T*)staging, &slots[i].timestamp);
+				if (pwrite(fd, staging, header.slot_bytes, header.data_offset + i * header.slot_bytes) != (ssize_t)header.slot_bytes)
+				{
+					failed += 1;
+				}
+			}
+			free(staging);
+		});
+	}
+	for (std::thread& w : writers)
+	{
+		w.join();
+	}
+
+	void* spare = NULL;
+	if (posix_memalign(&spare, header.alignment, header.slot_bytes) != 0)
+	{
+		::close(fd);
+		return -1;
+	}
+	memset(spare, 0, header.slot_bytes);
+	int64_t spare_timestamp = 0;
+	long spare_count = -1;
+	if (buf.copy_spare((T*)spare, &spare_count, &spare_timestamp, timeout_ms) != 0)
+	{
+		printf("CircAcqSnapshot: Failed to copy the locked out element.\n");
+		failed += 1;
+	}
+	else if (spare_count >= 0)
+	{
+		int i = (int)(spare_count % ring_size);
+		if (spare_count > slots[i].count)  // Its slot still holds the older element swapped in for it
+		{
+			slots[i].count = spare_count;
+			slots[i].timestamp = spare_timestamp;
+			if (pwrite(fd, spare, header.slot_bytes, header.data_offset + i * header.slot_bytes) != (ssize_t)header.slot_bytes)
+			{
+				failed += 1;
+			}
+		}
+	}
+	free(spare);
+
+	header.newest = -1;
+	for (int i = 0; i < ring_size; i++)
+	{
+		header.newest = std::max(header.newest, slots[i].count);
+	}
+	void* meta = NULL;
+	if (posix_memalign(&meta, header.alignment, header.data_offset) != 0)
+	{
+		::close(fd);
+		return -1;
+	}
+	memset(meta, 0, header.data_offset);
+	memcpy(meta, &header, sizeof(header));
+	memcpy((char*)meta + sizeof(header), slots.data(), sizeof(CircAcqSnapshotSlot) * ring_size);
+	if (pwrite(fd, meta, header.data_offset, 0) != (ssize_t)header.data_offset)
+	{
+		failed += 1;
+	}
+	free(meta);
+	close(fd);
+	if (failed.load() > 0)
+	{
+		printf("CircAcqSnapshot: Failed to write %s.\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+template <class T>
+class CircAcqSnapshot
+{
+protected:
+
+	void* map;
+	size_t length;
+	CircAcqBuffer<T>* buf;
+
+public:
+
+	CircAcqSnapshot()
+	{
+		map = NULL;
+		length = 0;
+		buf = NULL;
+	}
+
+	// Whether header describes a snapshot of T that fits in length bytes
+	static bool _valid(const CircAcqSnapshotHeader& header, uint64_t length)
+	{
+		if (memcmp(header.magic, CIRCACQ_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != CIRCACQ_SNAPSHOT_VERSION
+			|| header.element_bytes != sizeof(T) || header.ring_size < 1 || header.ring_size > INT_MAX || header.element_size == 0)
+		{
+			return false;
+		}
+		uint64_t slots = (uint64_t)header.ring_size;
+		if (header.element_size > UINT64_MAX / sizeof(T) || header.slot_bytes < header.element_size * sizeof(T)
+			|| slots > (length - sizeof(header)) / sizeof(CircAcqSnapshotSlot) || header.data_offset < sizeof(header) + slots * sizeof(CircAcqSnapshotSlot)
+			|| header.data_offset > length || slots > (length - header.data_offset) / header.slot_bytes)
+		{
+			return false;
+		}
+		return header.data_offset % alignof(T) == 0 && header.slot_bytes % alignof(T) == 0;
+	}
+
+	// Returns 0 on success, -1 if the file can't be mapped or isn't a snapshot of T
+	int open(const char* path)
+	{
+		int fd = ::open(path, O_RDONLY);
+		if (fd == -1)
+		{
+			printf("CircAcqSnapshot: Failed to open %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		struct stat st;
+		CircAcqSnapshotHeader check;
+		if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(check) || pread(fd, &check, sizeof(check), 0) != (ssize_t)sizeof(check)
+			|| !_valid(check, (uint64_t)st.st_size))
+		{
+			printf("CircAcqSnapshot: %s is not a snapshot of %i byte elements.\n", path, (int)sizeof(T));
+			::close(fd);
+			return -1;
+		}
+		length = (size_t)st.st_size;
+		map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED)
+		{
+			printf("CircAcqSnapshot: Failed to map %s.\n", path);
+			map = NULL;
+			return -1;
+		}
+		CircAcqSnapshotHeader* header = (CircAcqSnapshotHeader*)map;
+		CircAcqSnapshotSlot* table = (CircAcqSnapshotSlot*)(header + 1);
+		int ring_size = (int)header->ring_size;
+		std::vector<T*> slots(ring_size);
+		std::vector<long> counts(ring_size);
+		std::vector<int64_t> timestamps(ring_size);
+		for (int i = 0; i < ring_size; i++)
+		{
+			slots[i] = (T*)((char*)map + header->data_offset + i * header->slot_bytes);
+			counts[i] = (long)table[i].count;
+			timestamps[i] = table[i].timestamp;
+		}
+		buf = new CircAcqBuffer<T>(ring_size, header->element_size, slots.data(), counts.data(), timestamps.data(), (long)header->newest);
+		if (buf->set_layout((int)header->layout_type, header->layout_rows, header->layout_cols, header->layout_tile_rows, header->layout_tile_cols) != 0)
+		{
+			close();
+			return -1;
+		}
+		return 0;
+	}
+
+	CircAcqBuffer<T>* buffer()
+	{
+		return buf;
+	}
+
+	void close()
+	{
+		delete buf;
+		buf = NULL;
+		if (map != NULL)
+		{
+			munmap(map, length);
+			map = NULL;
+		}
+	}
+
+	~CircAcqSnapshot()
+	{
+		close();
+	}
+
+};
+
+#endif
@@ -0,0 +1,198 @@
+#pragma once
+#include "CircAcqBuffer.h"
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+Per-pixel temporal kernels over the k newest elements of a CircAcqBuffer.
+
+The window is pinned in the ring with pin_window() and read in place. Pixels are processed in tiles small
+enough that a tile from each of the k frames stays in cache while the kernel makes its passes over them,
+and the inner loops run across pixels with no dependencies between them so that the compiler vectorizes
+them. With threads > 1 the tiles are split between that many threads.
+
+Each kernel returns the count of the newest element in the window, or a CircAcqStatus if the window couldn't
+be pinned within timeout_ms. Results are written to caller buffers of the ring's element size.
+
+github.com/sstucker
+2021
+*/
+
+#define CIRCACQ_WINDOW_CACHE_BYTES (256 * 1024)  // Working set a tile across the window should fit in
+
+template <typename T>
+inline uint64_t circacq_window_tile(int k)
+{
+	uint64_t tile = CIRCACQ_WINDOW_CACHE_BYTES / (sizeof(T) * k) / 64 * 64;
+	return std::max(tile, (uint64_t)64);
+}
+
+// Pins the window and calls kernel(frames, first, last) over tiles of pixels, split across threads
+template <typename T, typename Kernel>
+inline long circacq_window_apply(CircAcqBuffer<T>& buf, int k, int timeout_ms, int threads, Kernel kernel)
+{
+	std::vector<const T*> frames(k);
+	long newest = buf.pin_window(k, frames.data(), timeout_ms);
+	if (newest < 0)
+	{
+		return newest;
+	}
+	uint64_t size = buf.get_element_size();
+	uint64_t tile = circacq_window_tile<T>(k);
+	uint64_t tiles = (size + tile - 1) / tile;
+	threads = (int)std::max((uint64_t)1, std::min((uint64_t)threads, tiles));
+	auto work = [&](int t)
+	{
+		for (uint64_t i = t; i < tiles; i += threads)
+		{
+			kernel(frames.data(), i * tile, std::min((i + 1) * tile, size));
+		}
+	};
+	std::vector<std::thread> pool;
+	for (int t = 1; t < threads; t++)
+	{
+		pool.emplace_back(work, t);
+	}
+	work(0);
+	for (std::thread& th : pool)
+	{
+		th.join();
+	}
+	buf.unpin_window(k, newest);
+	return newest;
+}
+
+template <typename T>
+long circacq_window_minmax(CircAcqBuffer<T>& buf, int k, T* min_out, T* max_out, int timeout_ms, int threads = 1)
+{
+	return circacq_window_apply(buf, k, timeout_ms, threads, [&](const T** frames, uint64_t first, uint64_t last)
+	{
+		T* lo = min_out + first;
+		T* hi = max_out + first;
+		uint64_t n = last - first;
+		memcpy(lo, frames[0] + first, sizeof(T) * n);
+		memcpy(hi, frames[0] + first, sizeof(T) * n);
+		for (int f = 1; f < k; f++)
+		{
+			const T* x = frames[f] + first;
+			for (uint64_t p = 0; p < n; p++)
+			{
+				lo[p] = x[p] < lo[p] ? x[p] : lo[p];
+				hi[p] = x[p] > hi[p] ? x[p] : hi[p];
+			}
+		}
+	});
+}
+
+// Population variance, computed in two passes over the tile so that it stays accurate for large means
+template <typename T>
+long circacq_window_variance(CircAcqBuffer<T>& buf, int k, float* mean_out, float* variance_out, int timeout_ms, int threads = 1)
+{
+	return circacq_window_apply(buf, k, timeout_ms, threads, [&](const T** frames, uint64_t first, uint64_t last)
+	{
+		float* mean = mean_out + first;
+		float* var = variance_out + first;
+		uint64_t n = last - first;
+		float scale = 1.0f / k;
+		std::fill(mean, mean + n, 0.0f);
+		std::fill(var, var + n, 0.0f);
+		for (int f = 0; f < k; f++)
+		{
+			const T* x = frames[f] + first;
+			for (uint64_t p = 0; p < n; p++)
+			{
+				mean[p] += (float)x[p];
+			}
+		}
+		for (uint64_t p = 0; p < n; p++)
+		{
+			mean[p] *= scale;
+		}
+		for (int f = 0; f < k; f++)
+		{
+			const T* x = frames[f] + first;
+			for (uint64_t p = 0; p < n; p++)
+			{
+				float d = (float)x[p] - mean[p];
+				var[p] += d * d;
+			}
+		}
+		for (uint64_t p = 0; p < n; p++)
+		{
+			var[p] *= scale;
+		}
+	});
+}
+
+// Exponential moving average from the oldest frame to the newest: out = out + alpha * (x - out)
+template <typename T>
+long circacq_window_ema(CircAcqBuffer<T>& buf, int k, float alpha, float* out, int timeout_ms, int threads = 1)
+{
+	return circacq_window_apply(buf, k, timeout_ms, threads, [&](const T** frames, uint64_t first, uint64_t last)
+	{
+		float* avg = out + first;
+		uint64_t n = last - first;
+		const T* x0 = frames[0] + first;
+		for (uint64_t p = 0; p < n; p++)
+		{
+			avg[p] = (float)x0[p];
+		}
+		for (int f = 1; f < k; f++)
+		{
+			const T* x = frames[f] + first;
+			for (uint64_t p = 0; p < n; p++)
+			{
+				avg[p] += alpha * ((float)x[p] - avg[p]);
+			}
+		}
+	});
+}
+
+/*
+Median of the window per pixel; for even k, the mean of the two middle values. The tile from each frame is
+gathered into scratch rows that are sorted against each other with an odd-even transposition network, every
+compare-exchange being an elementwise min/max across the tile.
+*/
+template <typename T>
+long circacq_window_median(CircAcqBuffer<T>& buf, int k, T* out, int timeout_ms, int threads = 1)
+{
+	return circacq_window_apply(buf, k, timeout_ms, threads, [&](const T** frames, uint64_t first, uint64_t last)
+	{
+		uint64_t n = last - first;
+		std::vector<T> rows(k * n);
+		for (int f = 0; f < k; f++)
+		{
+			memcpy(rows.data() + f * n, frames[f] + first, sizeof(T) * n);
+		}
+		for (int phase = 0; phase < k; phase++)
+		{
+			for (int f = phase % 2; f + 1 < k; f += 2)
+			{
+				T* a = rows.data() + f * n;
+				T* b = a + n;
+				for (uint64_t p = 0; p < n; p++)
+				{
+					T lo = a[p] < b[p] ? a[p] : b[p];
+					T hi = a[p] < b[p] ? b[p] : a[p];
+					a[p] = lo;
+					b[p] = hi;
+				}
+			}
+		}
+		const T* mid = rows.data() + (k / 2) * n;
+		if (k % 2 == 1)
+		{
+			memcpy(out + first, mid, sizeof(T) * n);
+		}
+		else
+		{
+			typedef typename std::conditional<std::is_integral<T>::value, int64_t, double>::type Wide;
+			const T* below = mid - n;
+			for (uint64_t p = 0; p < n; p++)
+			{
+				out[first + p] = (T)(((Wide)below[p] + (Wide)mid[p]) / 2);
+			}
+		}
+	});
+}
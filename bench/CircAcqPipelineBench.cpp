@@ -0,0 +1,367 @@
+/*
+Scenario benchmark for CircAcqBuffer modelled on a real acquisition pipeline.
+
+A producer pushes frames at a fixed rate while three consumers share one ring:
+
+	display    -- locks out the latest frame at ~60 Hz, skipping whatever it missed
+	recorder   -- locks out every frame in order and copies it out, counting drops
+	processing -- locks out the latest frame it hasn't seen and does work of variable cost
+
+The producer rate is stepped up from the starting rate until the recorder drops its first frame.
+For each step the dropped frames, per-consumer latency percentiles (push to lock-out) and producer
+jitter (actual push time vs. schedule) are reported.
+
+mode selects the thread configuration: "default" leaves scheduling to the OS, "isolated" pins the producer
+and each consumer to their own core with SCHED_FIFO priority and locked memory (see CircAcqRealtime.h),
+"compare" runs the scan once in each configuration. Scheduling latency from a calibration loop is reported
+for each configuration before its scan.
+
+fair set to 1 serves the consumers' lock outs in arrival order (CircAcqBuffer::set_fair) so that the
+per-consumer latency tails can be compared with the default free-for-all.
+
+usage: CircAcqPipelineBench [frame_elements] [ring_size] [start_hz] [step] [seconds_per_step] [max_steps] [mode] [priority] [fair]
+
+github.com/sstucker
+*/
+
+#include "../CircAcqBuffer.h"
+#include "../CircAcqRealtime.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef uint16_t px;
+
+const int STAMP_HISTORY = 1 << 16;  // Push timestamps kept per count modulo this
+
+enum Role { PRODUCER, RECORDER, PROCESSING, DISPLAY, N_ROLES };
+
+struct BenchConfig
+{
+	uint64_t frame_size = 512 * 512;
+	int ring_size = 64;
+	double start_hz = 1000.0;
+	double step = 1.25;
+	double seconds = 2.0;
+	int max_steps = 16;
+	bool isolated = false;
+	bool fair = false;
+	CircAcqThreadConfig threads[N_ROLES];  // Applied by each thread when isolated
+};
+
+struct ConsumerResult
+{
+	const char* name;
+	long frames = 0;
+	long dropped = 0;  // Frames the consumer wanted but found overwritten
+	long timeouts = 0;
+	std::vector<int64_t> latency_us;
+};
+
+struct StepResult
+{
+	double hz;
+	long pushed;
+	std::vector<int64_t> jitter_us;
+	ConsumerResult display, recorder, processing;
+};
+
+inline int64_t now_us()
+{
+	return std::chrono::duration_cast<us>(clk::now().time_since_epoch()).count();
+}
+
+inline int64_t percentile(std::vector<int64_t>& v, double p)
+{
+	if (v.empty())
+	{
+		return -1;
+	}
+	size_t i = (size_t)(p * (v.size() - 1));
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+inline void spin_until(clk::time_point t)
+{
+	while (clk::now() < t) {}
+}
+
+// Sleep most of the way, then spin, so the producer keeps its schedule without pegging the core between frames
+inline void wait_until(clk::time_point t)
+{
+	auto coarse = t - std::chrono::microseconds(200);
+	if (clk::now() < coarse)
+	{
+		std::this_thread::sleep_until(coarse);
+	}
+	spin_until(t);
+}
+
+class PipelineBench
+{
+protected:
+
+	BenchConfig cfg;
+	CircAcqBuffer<px>* buf;
+	std::vector<std::atomic<int64_t>> stamps;
+	std::atomic_bool running;
+
+	void record_latency(ConsumerResult& r, long n)
+	{
+		r.latency_us.push_back(now_us() - stamps[n % STAMP_HISTORY].load());
+	}
+
+	void configure(Role role)
+	{
+		if (cfg.isolated)
+		{
+			circacq_apply_thread_config(cfg.threads[role]);
+		}
+	}
+
+	void producer(double hz, StepResult& res)
+	{
+		configure(PRODUCER);
+		std::vector<px> frame(cfg.frame_size);
+		auto period = std::chrono::duration_cast<clk::duration>(std::chrono::duration<double>(1.0 / hz));
+		long total = (long)(hz * cfg.seconds);
+		auto t0 = clk::now() + std::chrono::milliseconds(10);
+		for (long i = 0; i < total; i++)
+		{
+			auto scheduled = t0 + i * period;
+			wait_until(scheduled);
+			auto actual = clk::now();
+			res.jitter_us.push_back(std::chrono::duration_cast<us>(actual - scheduled).count());
+			frame[0] = (px)i;
+			stamps[i % STAMP_HISTORY].store(now_us());
+			buf->push(frame.data());
+		}
+		res.pushed = total;
+	}
+
+	void display(ConsumerResult& r)
+	{
+		configure(DISPLAY);
+		px* p;
+		while (running.load())
+		{
+			long latest = buf->get_count();
+			if (latest >= 0)
+			{
+				long got = buf->lock_out(latest, &p, 100);
+				if (got < 0)
+				{
+					r.timeouts++;
+				}
+				else
+				{
+					record_latency(r, got);
+					r.frames++;
+					buf->release();
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(16667));
+		}
+	}
+
+	void recorder(ConsumerResult& r)
+	{
+		configure(RECORDER);
+		std::vector<px> disk(cfg.frame_size);  // Stands in for the write to disk
+		px* p;
+		long next = 0;
+		while (running.load() || next <= buf->get_count())
+		{
+			if (next > buf->get_count())
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			long got = buf->lock_out(next, &p, 100);
+			if (got < 0)
+			{
+				r.timeouts++;
+				if (!running.load())
+				{
+					break;  // Producer has stopped and the frame isn't coming
+				}
+				continue;
+			}
+			record_latency(r, got);
+			memcpy(disk.data(), p, sizeof(px) * cfg.frame_size);
+			buf->release();
+			r.dropped += got - next;
+			r.frames++;
+			next = got + 1;
+		}
+	}
+
+	void processing(ConsumerResult& r)
+	{
+		configure(PROCESSING);
+		std::mt19937 rng(76);
+		std::uniform_int_distribution<int> extra_us(100, 1500);
+		px* p;
+		long last = -1;
+		while (running.load())
+		{
+			long latest = buf->get_count();
+			if (latest <= last)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			long got = buf->lock_out(last + 1, &p, 100);
+			if (got < 0)
+			{
+				r.timeouts++;
+				continue;
+			}
+			record_latency(r, got);
+			uint64_t acc = 0;
+			for (uint64_t i = 0; i < cfg.frame_size; i++)
+			{
+				acc += p[i];
+			}
+			buf->release();
+			r.dropped += got - (last + 1);
+			r.frames++;
+			last = got;
+			spin_until(clk::now() + std::chrono::microseconds(extra_us(rng) + (int)(acc & 1)));
+		}
+	}
+
+public:
+
+	PipelineBench(BenchConfig config) : cfg(config), stamps(STAMP_HISTORY)
+	{
+		buf = new CircAcqBuffer<px>(cfg.ring_size, cfg.frame_size);
+		buf->set_fair(cfg.fair);
+	}
+
+	StepResult run(double hz)
+	{
+		StepResult res;
+		res.hz = hz;
+		res.display.name = "display";
+		res.recorder.name = "recorder";
+		res.processing.name = "processing";
+		buf->clear();
+		running.store(true);
+		std::thread td(&PipelineBench::display, this, std::ref(res.display));
+		std::thread tr(&PipelineBench::recorder, this, std::ref(res.recorder));
+		std::thread tp(&PipelineBench::processing, this, std::ref(res.processing));
+		std::thread tx(&PipelineBench::producer, this, hz, std::ref(res));
+		tx.join();
+		running.store(false);
+		td.join();
+		tr.join();
+		tp.join();
+		return res;
+	}
+
+	~PipelineBench()
+	{
+		delete buf;
+	}
+};
+
+void print_consumer(ConsumerResult& r)
+{
+	printf("  %-10s frames %8li  dropped %8li  timeouts %4li  latency us p50 %7lli p99 %7lli p99.9 %7lli max %7lli\n",
+		r.name, r.frames, r.dropped, r.timeouts,
+		(long long)percentile(r.latency_us, 0.5), (long long)percentile(r.latency_us, 0.99),
+		(long long)percentile(r.latency_us, 0.999), (long long)percentile(r.latency_us, 1.0));
+}
+
+void print_step(StepResult& res)
+{
+	printf("%9.1f Hz  pushed %8li  producer jitter us p50 %5lli p99 %5lli p99.9 %5lli max %6lli\n",
+		res.hz, res.pushed,
+		(long long)percentile(res.jitter_us, 0.5), (long long)percentile(res.jitter_us, 0.99),
+		(long long)percentile(res.jitter_us, 0.999), (long long)percentile(res.jitter_us, 1.0));
+	print_consumer(res.display);
+	print_consumer(res.recorder);
+	print_consumer(res.processing);
+}
+
+// Calibrate in a thread configured like the producer so the numbers are comparable to its jitter
+void print_sched_latency(BenchConfig& cfg)
+{
+	CircAcqSchedLatency lat;
+	std::thread t([&]()
+	{
+		if (cfg.isolated)
+		{
+			circacq_apply_thread_config(cfg.threads[PRODUCER]);
+		}
+		lat = circacq_measure_sched_latency(1000, 1000);
+	});
+	t.join();
+	printf("Scheduling latency (%s, %li wakeups) us p50 %lli p99 %lli p99.9 %lli max %lli\n",
+		cfg.isolated ? "isolated" : "default", lat.samples,
+		(long long)lat.p50_us, (long long)lat.p99_us, (long long)lat.p999_us, (long long)lat.max_us);
+}
+
+void scan(BenchConfig cfg)
+{
+	print_sched_latency(cfg);
+	PipelineBench bench(cfg);
+	double hz = cfg.start_hz;
+	for (int i = 0; i < cfg.max_steps; i++)
+	{
+		StepResult res = bench.run(hz);
+		print_step(res);
+		if (res.recorder.dropped > 0)
+		{
+			printf("First recorder drop at %.1f Hz\n", hz);
+			return;
+		}
+		hz *= cfg.step;
+	}
+	printf("No recorder drops up to %.1f Hz\n", hz / cfg.step);
+}
+
+int main(int argc, char** argv)
+{
+	BenchConfig cfg;
+	std::string mode = "default";
+	int priority = 80;
+	if (argc > 1) cfg.frame_size = strtoull(argv[1], NULL, 10);
+	if (argc > 2) cfg.ring_size = atoi(argv[2]);
+	if (argc > 3) cfg.start_hz = atof(argv[3]);
+	if (argc > 4) cfg.step = atof(argv[4]);
+	if (argc > 5) cfg.seconds = atof(argv[5]);
+	if (argc > 6) cfg.max_steps = atoi(argv[6]);
+	if (argc > 7) mode = argv[7];
+	if (argc > 8) priority = atoi(argv[8]);
+	if (argc > 9) cfg.fair = atoi(argv[9]) != 0;
+
+	int cores = std::max((int)std::thread::hardware_concurrency(), 1);
+	for (int i = 0; i < N_ROLES; i++)
+	{
+		cfg.threads[i].core = i % cores;
+		cfg.threads[i].priority = i == DISPLAY ? priority / 2 : priority;  // Display is allowed to lag
+	}
+
+	printf("CircAcqPipelineBench: %llu elements/frame, %i buffers, %.1f Hz start, x%.2f per step, %.1f s per step, %s lock outs\n",
+		(unsigned long long)cfg.frame_size, cfg.ring_size, cfg.start_hz, cfg.step, cfg.seconds, cfg.fair ? "fair" : "unordered");
+
+	if (mode == "default" || mode == "compare")
+	{
+		cfg.isolated = false;
+		scan(cfg);
+	}
+	if (mode == "isolated" || mode == "compare")
+	{
+		cfg.isolated = true;
+		circacq_lock_memory();
+		scan(cfg);
+	}
+	return 0;
+}
@@ -0,0 +1,130 @@
+"""
+ctypes wrapper around the CircAcqBuffer C ABI (CircAcqBufferC.h).
+
+Frames returned by lock_out() are numpy arrays created with np.frombuffer directly over the ring's slot
+memory, so no copy is made. They are only valid until release() is called; copy them if they need to
+outlive the lock out.
+
+github.com/sstucker
+2021
+"""
+
+import ctypes
+import os
+import sys
+
+import numpy as np
+
+MAX_DIMS = 4
+
+# Layouts for CircAcqBuffer.set_layout(), as CircAcqStoredLayout in CircAcqBufferC.h
+LAYOUT_ROW_MAJOR = 0
+LAYOUT_TRANSPOSED = 1
+LAYOUT_TILED = 2
+
+DTYPES = {
+    np.dtype(np.uint8): 0,
+    np.dtype(np.uint16): 1,
+    np.dtype(np.int16): 2,
+    np.dtype(np.int32): 3,
+    np.dtype(np.float32): 4,
+    np.dtype(np.float64): 5,
+}
+
+
+class FrameInfo(ctypes.Structure):
+    _fields_ = [
+        ("data", ctypes.c_void_p),
+        ("count", ctypes.c_int64),
+        ("dtype", ctypes.c_int32),
+        ("itemsize", ctypes.c_int32),
+        ("ndim", ctypes.c_int32),
+        ("shape", ctypes.c_uint64 * MAX_DIMS),
+        ("nbytes", ctypes.c_uint64),
+    ]
+
+
+def _default_library():
+    name = {"win32": "CircAcqBufferC.dll", "darwin": "libCircAcqBufferC.dylib"}.get(sys.platform, "libCircAcqBufferC.so")
+    return os.path.join(os.path.dirname(os.path.abspath(__file__)), name)
+
+
+def load(path=None):
+    lib = ctypes.CDLL(path or _default_library())
+    lib.circacq_create.restype = ctypes.c_void_p
+    lib.circacq_create.argtypes = [ctypes.c_int32, ctypes.c_int32, ctypes.c_int32, ctypes.POINTER(ctypes.c_uint64)]
+    lib.circacq_destroy.argtypes = [ctypes.c_void_p]
+    lib.circacq_push.restype = ctypes.c_int32
+    lib.circacq_push.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+    lib.circacq_lock_out.restype = ctypes.c_int64
+    lib.circacq_lock_out.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.c_int32, ctypes.POINTER(FrameInfo)]
+    lib.circacq_release.argtypes = [ctypes.c_void_p]
+    lib.circacq_shutdown.argtypes = [ctypes.c_void_p]
+    lib.circacq_set_correction.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+    lib.circacq_set_layout.restype = ctypes.c_int32
+    lib.circacq_set_layout.argtypes = [ctypes.c_void_p, ctypes.c_int32, ctypes.c_uint64, ctypes.c_uint64]
+    lib.circacq_get_count.restype = ctypes.c_int64
+    lib.circacq_get_count.argtypes = [ctypes.c_void_p]
+    lib.circacq_clear.argtypes = [ctypes.c_void_p]
+    return lib
+
+
+class CircAcqBuffer:
+
+    def __init__(self, number_of_buffers, shape, dtype=np.uint16, lib=None):
+        self.lib = lib or load()
+        self.dtype = np.dtype(dtype)
+        self.shape = tuple(int(s) for s in shape)
+        dims = (ctypes.c_uint64 * len(self.shape))(*self.shape)
+        self.handle = self.lib.circacq_create(DTYPES[self.dtype], number_of_buffers, len(self.shape), dims)
+        if not self.handle:
+            raise ValueError("Invalid ring configuration")
+
+    def push(self, frame):
+        """Copies frame, converted to the ring's dtype, into the ring. It must have one value per pixel of a frame."""
+        frame = np.ascontiguousarray(frame, dtype=self.dtype)
+        if frame.size != np.prod(self.shape):
+            raise ValueError("Frames must have one value per pixel of a frame")
+        return self.lib.circacq_push(self.handle, frame.ctypes.data)
+
+    def lock_out(self, n, timeout_ms=0):
+        """Returns (count, array) with the array viewing slot memory, or (status, None) on time out or shutdown."""
+        info = FrameInfo()
+        count = self.lib.circacq_lock_out(self.handle, n, timeout_ms, ctypes.byref(info))
+        if count < 0:
+            return count, None
+        raw = (ctypes.c_char * info.nbytes).from_address(info.data)
+        return count, np.frombuffer(raw, dtype=self.dtype).reshape(tuple(info.shape[:info.ndim]))
+
+    def set_correction(self, offset, gain):
+        """Frames are stored as (frame - offset) * gain. Pass None to turn correction off."""
+        if offset is None or gain is None:
+            self.lib.circacq_set_correction(self.handle, None, None)
+            return
+        offset = np.ascontiguousarray(offset, dtype=np.float32)
+        gain = np.ascontiguousarray(gain, dtype=np.float32)
+        if offset.size != np.prod(self.shape) or gain.size != np.prod(self.shape):
+            raise ValueError("Correction planes must have one value per pixel of a frame")
+        self.lib.circacq_set_correction(self.handle, offset.ctypes.data, gain.ctypes.data)
+
+    def set_layout(self, layout, tile_rows=1, tile_cols=1):
+        """LAYOUT_ROW_MAJOR, LAYOUT_TRANSPOSED or LAYOUT_TILED. Arrays from lock_out() take the stored layout's shape."""
+        if self.lib.circacq_set_layout(self.handle, layout, tile_rows, tile_cols) != 0:
+            raise ValueError("Invalid layout for this ring")
+
+    def release(self):
+        self.lib.circacq_release(self.handle)
+
+    def shutdown(self):
+        self.lib.circacq_shutdown(self.handle)
+
+    def get_count(self):
+        return self.lib.circacq_get_count(self.handle)
+
+    def clear(self):
+        self.lib.circacq_clear(self.handle)
+
+    def __del__(self):
+        if getattr(self, "handle", None):
+            self.lib.circacq_destroy(self.handle)
+            self.handle = None
@@ -0,0 +1,51 @@
+/*
+Pins down what shutdown() does to lock outs: every lock out fails with CIRCACQ_SHUTDOWN, including one of an
+element that is already available, until clear().
+
+usage: CircAcqShutdownTest, exits with the number of failed checks
+
+github.com/sstucker
+*/
+
+#include "../CircAcqBuffer.h"
+
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+	if (!ok)
+	{
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+int main()
+{
+	CircAcqBuffer<int> ring(8, 4);
+	int frame[4] = { 0 };
+	for (int i = 0; i < 3; i++)
+	{
+		ring.push(frame);
+	}
+	int* buffer;
+	check(ring.lock_out(1, &buffer, 10) == 1, "lock out before shutdown");
+	ring.release();
+
+	ring.shutdown();
+	check(ring.lock_out(1, &buffer, 10) == CIRCACQ_SHUTDOWN, "lock out of an available element after shutdown");
+	check(ring.lock_out(2, &buffer) == CIRCACQ_SHUTDOWN, "lock out without a timeout after shutdown");
+	check(ring.lock_out(5, &buffer, 10) == CIRCACQ_SHUTDOWN, "lock out of a future element after shutdown");
+	const int* window[2];
+	check(ring.pin_window(2, window, 10) == CIRCACQ_SHUTDOWN, "pin_window after shutdown");
+	int consumer = ring.register_consumer();
+	check(ring.lock_out(2, &buffer, 10, consumer) == CIRCACQ_SHUTDOWN, "consumer lock out after shutdown");
+
+	ring.clear();
+	ring.push(frame);
+	check(ring.lock_out(0, &buffer, 10) == 0, "lock out after clear");
+	ring.release();
+
+	printf("%s\n", failures == 0 ? "ok" : "failed");
+	return failures;
+}